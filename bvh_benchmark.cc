@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+// Compares BVH of Raytracer against NanoRT with primary rays of bunny
+
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include "nanort.h"
+
+#include "currender/renderer.h"
+#include "src/bvh.h"
+#include "ugu/timer.h"
+
+using currender::Bvh;
+using currender::Camera;
+using currender::Mesh;
+using currender::PinholeCamera;
+using currender::RayHit;
+using currender::RayPacket;
+using currender::Timer;
+
+namespace {
+
+const int kIteration = 10;
+
+struct Rays {
+  std::vector<Eigen::Vector3f> org;
+  std::vector<Eigen::Vector3f> dir;
+};
+
+void MakeRays(const Camera& camera, Rays* rays) {
+  rays->org.resize(camera.width() * camera.height());
+  rays->dir.resize(camera.width() * camera.height());
+  for (int y = 0; y < camera.height(); y++) {
+    for (int x = 0; x < camera.width(); x++) {
+      const int i = y * camera.width() + x;
+      camera.org_ray_w(x, y, &rays->org[i]);
+      camera.ray_w(x, y, &rays->dir[i]);
+    }
+  }
+}
+
+// returns prim id of each ray and average msecs
+double TraceNanort(const Mesh& mesh, const Rays& rays,
+                   std::vector<int>* prim_ids) {
+  std::vector<float> vertices;
+  std::vector<unsigned int> faces;
+  for (const auto& v : mesh.vertices()) {
+    vertices.insert(vertices.end(), {v[0], v[1], v[2]});
+  }
+  for (const auto& f : mesh.vertex_indices()) {
+    faces.insert(faces.end(), {static_cast<unsigned int>(f[0]),
+                               static_cast<unsigned int>(f[1]),
+                               static_cast<unsigned int>(f[2])});
+  }
+
+  Timer<> timer;
+  timer.Start();
+  nanort::BVHBuildOptions<float> options;
+  nanort::TriangleMesh<float> triangle_mesh(&vertices[0], &faces[0],
+                                            sizeof(float) * 3);
+  nanort::TriangleSAHPred<float> triangle_pred(&vertices[0], &faces[0],
+                                               sizeof(float) * 3);
+  nanort::BVHAccel<float> accel;
+  accel.Build(static_cast<unsigned int>(mesh.vertex_indices().size()),
+              triangle_mesh, triangle_pred, options);
+  timer.End();
+  printf("  NanoRT build       : %.2f msecs\n", timer.elapsed_msec());
+
+  prim_ids->assign(rays.org.size(), -1);
+  timer.Start();
+  for (int iter = 0; iter < kIteration; iter++) {
+    for (size_t i = 0; i < rays.org.size(); i++) {
+      nanort::Ray<float> ray;
+      for (int k = 0; k < 3; k++) {
+        ray.org[k] = rays.org[i][k];
+        ray.dir[k] = rays.dir[i][k];
+      }
+      ray.min_t = 0.0f;
+      ray.max_t = 1.0e+30f;
+      nanort::TriangleIntersector<> intersector(&vertices[0], &faces[0],
+                                                sizeof(float) * 3);
+      nanort::TriangleIntersection<> isect;
+      if (accel.Traverse(ray, intersector, &isect)) {
+        (*prim_ids)[i] = static_cast<int>(isect.prim_id);
+      }
+    }
+  }
+  timer.End();
+  return timer.elapsed_msec() / kIteration;
+}
+
+double TraceBvh(const Bvh& bvh, const Rays& rays, std::vector<int>* prim_ids) {
+  prim_ids->assign(rays.org.size(), -1);
+  Timer<> timer;
+  timer.Start();
+  for (int iter = 0; iter < kIteration; iter++) {
+    for (size_t i = 0; i < rays.org.size(); i++) {
+      RayHit hit;
+      if (bvh.Intersect(rays.org[i], rays.dir[i], 0.0f, 1.0e+30f, &hit)) {
+        (*prim_ids)[i] = hit.prim_id;
+      }
+    }
+  }
+  timer.End();
+  return timer.elapsed_msec() / kIteration;
+}
+
+// rays of 4x4 pixels are traced as a packet
+double TraceBvhPacket(const Bvh& bvh, const Camera& camera, const Rays& rays,
+                      std::vector<int>* prim_ids) {
+  prim_ids->assign(rays.org.size(), -1);
+  Timer<> timer;
+  timer.Start();
+  for (int iter = 0; iter < kIteration; iter++) {
+    for (int py = 0; py < camera.height(); py += 4) {
+      for (int px = 0; px < camera.width(); px += 4) {
+        RayPacket packet;
+        for (int j = 0; j < currender::kRayPacketSize; j++) {
+          const int x = std::min(px + j % 4, camera.width() - 1);
+          const int y = std::min(py + j / 4, camera.height() - 1);
+          const int i = y * camera.width() + x;
+          for (int k = 0; k < 3; k++) {
+            packet.org[k][j] = rays.org[i][k];
+            packet.dir[k][j] = rays.dir[i][k];
+          }
+          packet.min_t[j] = 0.0f;
+          packet.max_t[j] = 1.0e+30f;
+        }
+        bvh.Intersect(&packet);
+        for (int j = 0; j < currender::kRayPacketSize; j++) {
+          const int x = px + j % 4;
+          const int y = py + j / 4;
+          if (x < camera.width() && y < camera.height()) {
+            (*prim_ids)[y * camera.width() + x] = packet.prim_id[j];
+          }
+        }
+      }
+    }
+  }
+  timer.End();
+  return timer.elapsed_msec() / kIteration;
+}
+
+// Axis-aligned rays whose zero components are -0 must hit the same faces as
+// ones with +0. Returns # of rays differ, or -1 if no ray hits
+int CheckSignedZeroRays(const Bvh& bvh) {
+  const Eigen::Vector3f center = (bvh.bb_min() + bvh.bb_max()) * 0.5f;
+  const Eigen::Vector3f extent = bvh.bb_max() - bvh.bb_min();
+  int num_hits = 0;
+  int num_differ = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    for (float sign : {-1.0f, 1.0f}) {
+      RayPacket positive, negative;
+      for (int j = 0; j < currender::kRayPacketSize; j++) {
+        // 4x4 grid on plane perpendicular to axis outside of bounds
+        Eigen::Vector3f org = center;
+        org[(axis + 1) % 3] += extent[(axis + 1) % 3] * ((j % 4) - 1.5f) / 4;
+        org[(axis + 2) % 3] += extent[(axis + 2) % 3] * ((j / 4) - 1.5f) / 4;
+        org[axis] -= sign * extent[axis];
+        for (int k = 0; k < 3; k++) {
+          positive.org[k][j] = negative.org[k][j] = org[k];
+          positive.dir[k][j] = k == axis ? sign : 0.0f;
+          negative.dir[k][j] = k == axis ? sign : -0.0f;
+        }
+        positive.min_t[j] = negative.min_t[j] = 0.0f;
+        positive.max_t[j] = negative.max_t[j] = 1.0e+30f;
+      }
+      RayPacket positive_any = positive, negative_any = negative;
+      bvh.Intersect(&positive);
+      bvh.Intersect(&negative);
+      bvh.Occluded(&positive_any);
+      bvh.Occluded(&negative_any);
+      for (int j = 0; j < currender::kRayPacketSize; j++) {
+        const Eigen::Vector3f org(negative.org[0][j], negative.org[1][j],
+                                  negative.org[2][j]);
+        const Eigen::Vector3f dir(negative.dir[0][j], negative.dir[1][j],
+                                  negative.dir[2][j]);
+        RayHit hit;
+        const bool is_hit = bvh.Intersect(org, dir, 0.0f, 1.0e+30f, &hit);
+        const bool is_occluded = bvh.Occluded(org, dir, 0.0f, 1.0e+30f);
+        num_hits += positive.prim_id[j] >= 0 ? 1 : 0;
+        num_differ +=
+            (negative.prim_id[j] != positive.prim_id[j] ||
+             (is_hit ? hit.prim_id : -1) != positive.prim_id[j] ||
+             is_occluded != (positive.prim_id[j] >= 0) ||
+             (negative_any.prim_id[j] >= 0) != (positive_any.prim_id[j] >= 0))
+                ? 1
+                : 0;
+      }
+    }
+  }
+  return num_hits > 0 ? num_differ : -1;
+}
+
+int CountDifferent(const std::vector<int>& a, const std::vector<int>& b) {
+  int count = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    count += a[i] != b[i] ? 1 : 0;
+  }
+  return count;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  (void)argc;
+  (void)argv;
+
+  // same data as examples.cc
+  std::string data_dir = "../data/bunny/";
+  std::string obj_path = data_dir + "bunny.obj";
+  std::ifstream ifs(obj_path);
+  if (!ifs.is_open()) {
+    printf("Please put %s\n", obj_path.c_str());
+    return -1;
+  }
+  Mesh mesh;
+  mesh.LoadObj(obj_path, data_dir);
+
+  // KinectV1 intrinsics of Freiburg 1 RGB in VGA
+  std::shared_ptr<Camera> camera = std::make_shared<PinholeCamera>(
+      640, 480, Eigen::Affine3d::Identity(), Eigen::Vector2f(318.6f, 255.3f),
+      Eigen::Vector2f(517.3f, 516.5f));
+  Rays rays;
+  MakeRays(*camera, &rays);
+
+  printf("# of triangles: %d, # of rays: %d\n",
+         static_cast<int>(mesh.vertex_indices().size()),
+         static_cast<int>(rays.org.size()));
+
+  std::vector<int> nanort_ids;
+  const double nanort_msec = TraceNanort(mesh, rays, &nanort_ids);
+
+  // build time and quality of presets
+  const char* quality_names[3] = {"fast", "medium", "high"};
+  for (int q = 0; q < 3; q++) {
+    currender::BvhBuildOption option;
+    option.quality = static_cast<currender::BvhQuality>(q);
+    Bvh preset;
+    preset.Build(mesh.vertices(), mesh.vertex_indices(), option);
+    printf("  Bvh build (%-6s) : %.2f msecs, SAH cost %.2f\n",
+           quality_names[q], preset.stats().build_msec,
+           preset.stats().sah_cost);
+  }
+
+  Bvh bvh;
+  bvh.Build(mesh.vertices(), mesh.vertex_indices());
+
+  std::vector<int> bvh_ids, packet_ids;
+  const double bvh_msec = TraceBvh(bvh, rays, &bvh_ids);
+  const double packet_msec = TraceBvhPacket(bvh, *camera, rays, &packet_ids);
+
+  printf("  NanoRT trace       : %.2f msecs\n", nanort_msec);
+  printf("  Bvh trace          : %.2f msecs (%d rays differ)\n", bvh_msec,
+         CountDifferent(nanort_ids, bvh_ids));
+  printf("  Bvh packet trace   : %.2f msecs (%d rays differ)\n", packet_msec,
+         CountDifferent(nanort_ids, packet_ids));
+
+  const int signed_zero_differ = CheckSignedZeroRays(bvh);
+  printf("  -0 direction rays  : %d rays differ from +0\n",
+         signed_zero_differ);
+  if (signed_zero_differ != 0) {
+    printf("Rays with -0 direction component are traced wrongly\n");
+    return -1;
+  }
+
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <vector>
 
+#include "currender/hybrid_renderer.h"
 #include "currender/rasterizer.h"
 #include "currender/raytracer.h"
 #include "ugu/util.h"
@@ -19,6 +20,7 @@ using currender::Depth2Gray;
 using currender::Depth2Mesh;
 using currender::Depth2PointCloud;
 using currender::FaceId2RandomColor;
+using currender::HybridRenderer;
 using currender::Image1b;
 using currender::Image1f;
 using currender::Image1i;
@@ -32,6 +34,8 @@ using currender::Normal2Color;
 using currender::PinholeCamera;
 using currender::Renderer;
 using currender::RendererOption;
+using currender::Scene;
+using currender::ShadowOption;
 using currender::WriteFaceIdAsText;
 
 namespace {
@@ -134,6 +138,138 @@ void Test(const std::string& out_dir, std::shared_ptr<Mesh> mesh,
   currender::WriteTumFormat(poses, out_dir + "tumpose.txt");
 }
 
+// Renders front view with shadow of light from top. Head of bunny casts
+// shadow on its paws, so some pixels facing the light must get darker than
+// without shadow
+bool TestShadow(const std::string& out_dir, std::shared_ptr<Mesh> mesh,
+                std::shared_ptr<Camera> camera, const RendererOption& option) {
+  MeshStats stats = mesh->stats();
+  Eigen::Vector3f diff = stats.bb_max - stats.bb_min;
+  float offset = std::max(diff[0], std::max(diff[1], diff[2])) * 1.5f;
+  Eigen::Vector3f eye = stats.center;
+  eye[2] -= offset;
+  Eigen::Matrix4f c2w_mat;
+  currender::c2w(eye, stats.center, Eigen::Vector3f(0, -1, 0), &c2w_mat);
+  camera->set_c2w(Eigen::Affine3d(c2w_mat.cast<double>()));
+
+  HybridRenderer renderer(option);
+  renderer.set_mesh(mesh);
+  if (!renderer.PrepareMesh()) {
+    return false;
+  }
+  renderer.set_camera(camera);
+
+  Image3b color, shadow_color;
+  Image1i face_id;
+  if (!renderer.Render(&color, nullptr, nullptr, nullptr, &face_id)) {
+    return false;
+  }
+
+  // axis-aligned light (y:down) whose other components become -0 inside
+  ShadowOption shadow_option;
+  shadow_option.enabled = true;
+  shadow_option.light_dir = Eigen::Vector3f(0.0f, 1.0f, 0.0f);
+  renderer.set_shadow_option(shadow_option);
+  if (!renderer.RenderColor(&shadow_color)) {
+    return false;
+  }
+  imwrite(out_dir + "front_shadow_color.png", shadow_color);
+
+  // darkened pixels facing the light are occluded by the other part of mesh
+  const Eigen::Vector3f light_w = -shadow_option.light_dir;
+  int num_occluded = 0;
+  for (int y = 0; y < face_id.rows; y++) {
+    for (int x = 0; x < face_id.cols; x++) {
+      const int fid = face_id.at<int>(y, x);
+      if (fid < 0 || mesh->face_normals()[fid].dot(light_w) <= 0.0f) {
+        continue;
+      }
+      const currender::Vec3b& c = color.at<currender::Vec3b>(y, x);
+      const currender::Vec3b& s = shadow_color.at<currender::Vec3b>(y, x);
+      if (s[0] + s[1] + s[2] < c[0] + c[1] + c[2]) {
+        num_occluded++;
+      }
+    }
+  }
+  printf("# of pixels in cast shadow: %d\n", num_occluded);
+
+  return num_occluded > 0;
+}
+
+// Renders two instances of the same mesh, the second one is half size on the
+// right. Both must be hit and shaded as the same mesh placed by pose, so mean
+// color of them should be close
+bool TestScene(const std::string& out_dir, std::shared_ptr<Mesh> mesh,
+               std::shared_ptr<Camera> camera, RendererOption option) {
+  MeshStats stats = mesh->stats();
+  Eigen::Vector3f diff = stats.bb_max - stats.bb_min;
+  float size = std::max(diff[0], std::max(diff[1], diff[2]));
+  const Eigen::Vector3d center = stats.center.cast<double>();
+  const Eigen::Vector3d shift(size * 1.0, 0.0, 0.0);
+
+  std::shared_ptr<Scene> scene = std::make_shared<Scene>();
+  scene->AddObject(mesh);
+  // scale around center of mesh
+  Eigen::Affine3d pose = Eigen::Translation3d(center + shift) *
+                         Eigen::Scaling(0.5) * Eigen::Translation3d(-center);
+  scene->AddObject(mesh, pose);
+
+  Eigen::Vector3f look_at = (center + shift * 0.5).cast<float>();
+  Eigen::Vector3f eye = look_at;
+  eye[2] -= size * 2.5f;
+  Eigen::Matrix4f c2w_mat;
+  currender::c2w(eye, look_at, Eigen::Vector3f(0, -1, 0), &c2w_mat);
+  camera->set_c2w(Eigen::Affine3d(c2w_mat.cast<double>()));
+
+  // trilinear interpolation uses derivatives of world position
+  option.interp = currender::ColorInterpolation::kTrilinear;
+  currender::Raytracer renderer(option);
+  renderer.set_scene(scene);
+  if (!renderer.PrepareMesh()) {
+    return false;
+  }
+  renderer.set_camera(camera);
+
+  Image3b color;
+  Image1i face_id, object_id;
+  Image3b vis_object_id;
+  if (!renderer.Render(&color, nullptr, nullptr, nullptr, &face_id) ||
+      !renderer.RenderObjectId(&object_id)) {
+    return false;
+  }
+  imwrite(out_dir + "scene_color.png", color);
+  FaceId2RandomColor(object_id, &vis_object_id);
+  imwrite(out_dir + "scene_vis_object_id.png", vis_object_id);
+
+  int count[2] = {0, 0};
+  double sum[2] = {0.0, 0.0};
+  for (int y = 0; y < object_id.rows; y++) {
+    for (int x = 0; x < object_id.cols; x++) {
+      const int id = object_id.at<int>(y, x);
+      if (id < 0) {
+        continue;
+      }
+      const int fid = face_id.at<int>(y, x);
+      if (id > 1 || fid < 0 ||
+          fid >= static_cast<int>(mesh->vertex_indices().size())) {
+        printf("wrong object id %d or face id %d\n", id, fid);
+        return false;
+      }
+      const currender::Vec3b& c = color.at<currender::Vec3b>(y, x);
+      count[id]++;
+      sum[id] += c[0] + c[1] + c[2];
+    }
+  }
+  const double mean[2] = {count[0] > 0 ? sum[0] / count[0] : 0.0,
+                          count[1] > 0 ? sum[1] / count[1] : 0.0};
+  printf("# of pixels of objects: %d, %d, mean color: %.1f, %.1f\n",
+         count[0], count[1], mean[0], mean[1]);
+
+  // smaller one covers fewer pixels. Normals of scaled one are normalized
+  return count[0] > count[1] && count[1] > 0 && mean[1] > 0.0 &&
+         mean[0] < mean[1] * 2.0 && mean[1] < mean[0] * 2.0;
+}
+
 void AlignMesh(std::shared_ptr<Mesh> mesh) {
   // move center as origin
   MeshStats stats = mesh->stats();
@@ -218,5 +354,17 @@ int main(int argc, char* argv[]) {
   // test
   Test(data_dir, mesh, camera, *renderer);
 
+  // shadow by rasterization and BVH
+  if (!TestShadow(data_dir, mesh, camera, option)) {
+    printf("HybridRenderer cast no shadow\n");
+    return -1;
+  }
+
+  // two instances of mesh in scene
+  if (!TestScene(data_dir, mesh, camera, option)) {
+    printf("Raytracer rendered scene wrongly\n");
+    return -1;
+  }
+
   return 0;
 }
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "currender/rasterizer.h"
+#include "currender/raytracer.h"
+
+namespace currender {
+
+// Shadow of a directional light cast by the mesh itself
+struct ShadowOption {
+  bool enabled{false};
+  // Direction of light travel in world coordinate (from light to surface)
+  Eigen::Vector3f light_dir{0.0f, 0.0f, 1.0f};
+  // Color of shadowed pixels is multiplied by this
+  float attenuation{0.5f};
+  // Offset of shadow ray origin from surface to avoid self-intersection,
+  // relative to diagonal of mesh bounding box
+  float bias{1.0e-4f};
+};
+
+// Primary visibility (face id, depth and barycentric) is rasterized and BVH
+// is used only for secondary rays (shadow) starting at surface positions
+// interpolated by the barycentric. Both are prepared from the same mesh in
+// PrepareMesh() but keep their own data
+// Like Rasterizer, one instance must not render from multiple threads at once
+class HybridRenderer : public Renderer {
+  class Impl;
+  std::unique_ptr<Impl> pimpl_;
+
+ public:
+  HybridRenderer();
+  ~HybridRenderer() override;
+
+  // Set option
+  explicit HybridRenderer(const RendererOption& option);
+  void set_option(const RendererOption& option) override;
+
+  // Set mesh
+  void set_mesh(std::shared_ptr<const Mesh> mesh) override;
+
+  // Should call after set_mesh() and before Render()
+  // Don't modify mesh outside after calling PrepareMesh()
+  bool PrepareMesh() override;
+
+  // Set option of BVH build in PrepareMesh()
+  void set_bvh_build_option(const BvhBuildOption& option);
+
+  // Set shadow applied to color
+  void set_shadow_option(const ShadowOption& option);
+
+  // Set camera
+  void set_camera(std::shared_ptr<const Camera> camera) override;
+
+  // Rendering all images
+  // If you don't need some of them, pass nullptr
+  bool Render(Image3b* color, Image1f* depth, Image3f* normal, Image1b* mask,
+              Image1i* face_id) const override;
+
+  // Rendering a image
+  bool RenderColor(Image3b* color) const override;
+  bool RenderDepth(Image1f* depth) const override;
+  bool RenderNormal(Image3f* normal) const override;
+  bool RenderMask(Image1b* mask) const override;
+  bool RenderFaceId(Image1i* face_id) const override;
+
+  // These Image1w* depth interfaces are prepared for widely used 16 bit
+  // (unsigned short) and mm-scale depth image format
+  bool RenderW(Image3b* color, Image1w* depth, Image3f* normal, Image1b* mask,
+               Image1i* face_id) const override;
+  bool RenderDepthW(Image1w* depth) const override;
+
+  // Statistics of the last rasterization and BVH build
+  const RasterizerStats& stats() const;
+  const BvhStats& bvh_stats() const;
+};
+
+}  // namespace currender
@@ -5,12 +5,29 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
 
 #include "currender/renderer.h"
 
 namespace currender {
 
+// Counters of the last rendering to see how much work is rejected by culling
+struct RasterizerStats {
+  int64_t chunks{0};                // # of face chunks
+  int64_t chunks_culled{0};         // chunks out of view frustum
+  int64_t triangles{0};             // # of triangles passed setup
+  int64_t tile_tests{0};            // # of (triangle, tile) pairs by binning
+  int64_t tile_depth_rejected{0};   // rejected by hierarchical z of tile
+  int64_t block_tests{0};           // # of (triangle, pixel block) pairs
+  int64_t block_edge_rejected{0};   // block is outside of triangle
+  int64_t block_depth_rejected{0};  // rejected by hierarchical z of block
+  int64_t block_depth_accepted{0};  // per-pixel depth test is skipped
+};
+
+// Render*() are const but reuse buffers, vertex cache and stats kept in the
+// instance. Don't call them of one instance from multiple threads at once;
+// use an instance per thread instead
 class Rasterizer : public Renderer {
   class Impl;
   std::unique_ptr<Impl> pimpl_;
@@ -50,6 +67,15 @@ class Rasterizer : public Renderer {
   bool RenderW(Image3b* color, Image1w* depth, Image3f* normal, Image1b* mask,
                Image1i* face_id) const override;
   bool RenderDepthW(Image1w* depth) const override;
+
+  // Statistics of the last rendering
+  const RasterizerStats& stats() const;
+
+  // Perspective-correct barycentric of the last rendering with color or
+  // normal. k-th image is weight of k-th vertex of the face in face id image
+  // and valid only at pixels with face id. nullptr if not rasterized
+  // Overwritten by the next rendering
+  const Image1f* barycentric() const;
 };
 
 }  // namespace currender
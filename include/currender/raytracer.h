@@ -5,14 +5,45 @@
 
 #pragma once
 
-#ifdef CURRENDER_USE_NANORT
-
 #include <memory>
+#include <vector>
 
 #include "currender/renderer.h"
+#include "currender/scene.h"
 
 namespace currender {
 
+// Trade-off between BVH quality (rendering speed) and build speed
+enum class BvhQuality {
+  kFast = 0,    // Split at spatial median of primitive centroids
+  kMedium = 1,  // Binned SAH along the longest axis of centroids
+  kHigh = 2     // Binned SAH along all axes
+};
+
+struct BvhBuildOption {
+  BvhQuality quality{BvhQuality::kMedium};
+  // Node with primitives not more than this becomes a leaf
+  // 1 to 4 since triangles of a leaf are tested at once by 4-wide SIMD
+  int min_leaf_primitives{4};
+  // # of bins for SAH. 2 to 256
+  int bin_size{16};
+};
+
+// Statistics of the last BVH build
+struct BvhStats {
+  int num_nodes{0};
+  int num_leaves{0};
+  int max_depth{0};
+  double build_msec{0.0};
+  // expected cost of traversal by surface area heuristic, relative to root
+  // bounds. Grows as refitted bounds get loose
+  float sah_cost{0.0f};
+};
+
+// Render*() are const but update the table of primary rays cached for the
+// camera pose. Camera may be moved outside after set_camera(), so the table
+// can not be updated there. Don't call them of one instance from multiple
+// threads at once; use an instance per thread instead
 class Raytracer : public Renderer {
   class Impl;
   std::unique_ptr<Impl> pimpl_;
@@ -28,10 +59,28 @@ class Raytracer : public Renderer {
   // Set mesh
   void set_mesh(std::shared_ptr<const Mesh> mesh) override;
 
+  // Set scene of multiple objects instead of a mesh
+  // Each mesh has its own BVH under top-level BVH over objects. Call
+  // PrepareMesh() again after objects move. Then only top-level BVH is
+  // rebuilt for meshes already prepared
+  // Output face id is index of face in mesh of the object
+  void set_scene(std::shared_ptr<const Scene> scene);
+
   // Should call after set_mesh() and before Render()
   // Don't modify mesh outside after calling PrepareMesh()
   bool PrepareMesh() override;
 
+  // Update mesh whose topology (vertex and face indices) is the same as the
+  // prepared one but vertices are moved (e.g. deforming mesh) after
+  // PrepareMesh(). BVH is refitted instead of rebuilt unless its quality gets
+  // much worse. Normals of mesh should be updated for shading and culling
+  // Textures are copied again only if their buffers are replaced. Call
+  // PrepareMesh() after editing texels in place
+  bool UpdateMesh(std::shared_ptr<const Mesh> mesh);
+
+  // Set option of BVH build in PrepareMesh()
+  void set_bvh_build_option(const BvhBuildOption& option);
+
   // Set camera
   void set_camera(std::shared_ptr<const Camera> camera) override;
 
@@ -47,13 +96,28 @@ class Raytracer : public Renderer {
   bool RenderMask(Image1b* mask) const override;
   bool RenderFaceId(Image1i* face_id) const override;
 
+  // Id of object in scene at each pixel. -1 if no hit. 0 for set_mesh()
+  bool RenderObjectId(Image1i* object_id) const;
+
   // These Image1w* depth interfaces are prepared for widely used 16 bit
   // (unsigned short) and mm-scale depth image format
   bool RenderW(Image3b* color, Image1w* depth, Image3f* normal, Image1b* mask,
                Image1i* face_id) const override;
   bool RenderDepthW(Image1w* depth) const override;
+
+  // Visibility of points in world coordinate from camera. 255 if a point is
+  // inside of image and depth range, and nothing is hit between the camera
+  // and the point, 0 otherwise. Both sides of faces occlude regardless of
+  // back-face culling. Hits within eps (relative to the distance) in front of
+  // the point are ignored for points on the surface
+  // Faster than rendering depth since traversal ends at any hit
+  bool IsVisible(const std::vector<Eigen::Vector3f>& points,
+                 std::vector<unsigned char>* visible,
+                 float eps = 1.0e-4f) const;
+
+  // Statistics of BVH built or loaded by the last PrepareMesh()
+  // That of top-level BVH for scene
+  const BvhStats& bvh_stats() const;
 };
 
 }  // namespace currender
-
-#endif
@@ -5,7 +5,9 @@
 
 #pragma once
 
+#include <limits>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "ugu/camera.h"
@@ -18,7 +20,7 @@ using namespace ugu;
 // Diffuse color
 enum class DiffuseColor {
   kNone = 0,     // Default white color
-  kTexture = 1,  // From diffuse uv texture
+  kTexture = 1,  // From diffuse uv texture copied in PrepareMesh()
   kVertex = 2    // From vertex color
 };
 
@@ -42,8 +44,11 @@ enum class DiffuseShading {
 // Interpolation method in texture uv space
 // Meaningful only if DiffuseColor::kTexture is specified otherwise ignored
 enum class ColorInterpolation {
-  kNn = 0,       // Nearest Neigbor
-  kBilinear = 1  // Bilinear interpolation
+  kNn = 0,        // Nearest Neigbor
+  kBilinear = 1,  // Bilinear interpolation
+  // Bilinear interpolation between two levels of mipmap selected by
+  // footprint of pixel in texture. Mipmaps are built in PrepareMesh()
+  kTrilinear = 2
 };
 
 struct RendererOption {
@@ -56,6 +61,22 @@ struct RendererOption {
   bool backface_culling{true};   // Back-face culling flag
   float oren_nayar_sigma{0.3f};  // Oren-Nayar's sigma
 
+  // Near and far plane in camera coordinate z
+  // Surface out of [near_z, far_z] is clipped
+  float near_z{0.0001f};
+  float far_z{std::numeric_limits<float>::max()};
+
+  // Reorder faces and vertices internally in PrepareMesh() for memory
+  // locality. Output face id is still the original index
+  // Used only by rasterization. BVH copies triangles to its leaves and is not
+  // affected by order of faces
+  bool reorder_mesh{false};
+
+  // Directory to cache BVH of Raytracer. If not empty, BVH is saved there
+  // with hash of mesh as file name and memory-mapped by the next
+  // PrepareMesh() of the same mesh instead of building
+  std::string bvh_cache_dir;
+
   RendererOption() {}
   ~RendererOption() {}
   void CopyTo(RendererOption* dst) const {
@@ -65,6 +86,11 @@ struct RendererOption {
     dst->shading_normal = shading_normal;
     dst->diffuse_shading = diffuse_shading;
     dst->backface_culling = backface_culling;
+    dst->oren_nayar_sigma = oren_nayar_sigma;
+    dst->near_z = near_z;
+    dst->far_z = far_z;
+    dst->reorder_mesh = reorder_mesh;
+    dst->bvh_cache_dir = bvh_cache_dir;
   }
 };
 
@@ -82,6 +108,8 @@ class Renderer {
 
   // Should call after set_mesh() and before Render()
   // Don't modify mesh outside after calling PrepareMesh()
+  // Diffuse textures are copied to tiled layout for sampling here. Call this
+  // again after editing texture in place, otherwise the old copy is rendered
   virtual bool PrepareMesh() = 0;
 
   // Set camera
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ugu/mesh.h"
+
+namespace currender {
+
+using namespace ugu;
+
+// Objects made of meshes placed in world coordinate by poses
+// A mesh can be shared by multiple objects (instancing). Renderer prepares
+// geometry of each mesh only once
+class Scene {
+  struct Object {
+    std::shared_ptr<const Mesh> mesh;
+    Eigen::Matrix3d rotation;  // object to world. may include scale
+    Eigen::Vector3d translation;
+  };
+  std::vector<Object> objects_;
+
+ public:
+  Scene();
+  ~Scene();
+
+  // Returns id of added object. Object ids are sequential from 0
+  int AddObject(std::shared_ptr<const Mesh> mesh,
+                const Eigen::Affine3d& pose = Eigen::Affine3d::Identity());
+  void Clear();
+
+  // Object to world transform
+  bool set_pose(int id, const Eigen::Affine3d& pose);
+  Eigen::Affine3d pose(int id) const;
+
+  int num_objects() const;
+  std::shared_ptr<const Mesh> mesh(int id) const;
+};
+
+}  // namespace currender
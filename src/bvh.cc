@@ -0,0 +1,1476 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "src/bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+
+// SSE2 is always available on x86-64 so that no runtime dispatch is needed
+// unlike rasterization kernels
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CURRENDER_BVH_USE_SSE
+#endif
+
+#include "src/util_private.h"
+#include "ugu/timer.h"
+
+namespace {
+
+using currender::BvhLeaf;
+using currender::BvhNode;
+using currender::BvhStats;
+using currender::RayHit;
+using currender::RayPacket;
+using currender::kRayPacketSize;
+
+
+// Object median split is used instead of SAH below this depth to bound tree
+// depth and traversal stack
+const int kMaxSahDepth = 24;
+const int kMaxStackSize = 256;
+
+const float kInf = std::numeric_limits<float>::infinity();
+
+// 4 floats processed at once
+#ifdef CURRENDER_BVH_USE_SSE
+struct Float4 {
+  __m128 v;
+};
+inline Float4 Load4(const float* p) { return {_mm_loadu_ps(p)}; }
+inline Float4 Set4(float a) { return {_mm_set1_ps(a)}; }
+inline void Store4(float* p, Float4 a) { _mm_storeu_ps(p, a.v); }
+inline Float4 operator+(Float4 a, Float4 b) { return {_mm_add_ps(a.v, b.v)}; }
+inline Float4 operator-(Float4 a, Float4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline Float4 operator*(Float4 a, Float4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline Float4 operator/(Float4 a, Float4 b) { return {_mm_div_ps(a.v, b.v)}; }
+inline Float4 Min4(Float4 a, Float4 b) { return {_mm_min_ps(a.v, b.v)}; }
+inline Float4 Max4(Float4 a, Float4 b) { return {_mm_max_ps(a.v, b.v)}; }
+// bit i is set if a[i] <= b[i]
+inline int LessEqual4(Float4 a, Float4 b) {
+  return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+}
+inline int NotEqual4(Float4 a, Float4 b) {
+  return _mm_movemask_ps(_mm_cmpneq_ps(a.v, b.v));
+}
+#else
+struct Float4 {
+  float v[4];
+};
+inline Float4 Load4(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+inline Float4 Set4(float a) { return {{a, a, a, a}}; }
+inline void Store4(float* p, Float4 a) { std::copy(a.v, a.v + 4, p); }
+#define CURRENDER_BVH_FLOAT4_OP(name, expr) \
+  inline Float4 name(Float4 a, Float4 b) {  \
+    Float4 r;                               \
+    for (int i = 0; i < 4; i++) {           \
+      r.v[i] = expr;                        \
+    }                                       \
+    return r;                               \
+  }
+CURRENDER_BVH_FLOAT4_OP(operator+, a.v[i] + b.v[i])
+CURRENDER_BVH_FLOAT4_OP(operator-, a.v[i] - b.v[i])
+CURRENDER_BVH_FLOAT4_OP(operator*, a.v[i] * b.v[i])
+CURRENDER_BVH_FLOAT4_OP(operator/, a.v[i] / b.v[i])
+CURRENDER_BVH_FLOAT4_OP(Min4, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+CURRENDER_BVH_FLOAT4_OP(Max4, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+#undef CURRENDER_BVH_FLOAT4_OP
+inline int LessEqual4(Float4 a, Float4 b) {
+  int mask = 0;
+  for (int i = 0; i < 4; i++) {
+    mask |= (a.v[i] <= b.v[i]) << i;
+  }
+  return mask;
+}
+inline int NotEqual4(Float4 a, Float4 b) {
+  int mask = 0;
+  for (int i = 0; i < 4; i++) {
+    mask |= (a.v[i] != b.v[i]) << i;
+  }
+  return mask;
+}
+#endif
+
+// Ray broadcasted to 4 lanes
+struct Ray4 {
+  Float4 org[3];
+  Float4 dir[3];
+  Float4 inv_dir[3];
+  int negative[3];  // 1 if sign bit of direction is set along axis
+};
+
+inline void MakeRay4(const float org[3], const float dir[3], Ray4* ray) {
+  for (int k = 0; k < 3; k++) {
+    ray->org[k] = Set4(org[k]);
+    ray->dir[k] = Set4(dir[k]);
+    ray->inv_dir[k] = Set4(1.0f / dir[k]);
+    // sign bit instead of comparison so that -0 (inv_dir is -inf) orders
+    // slabs the same way as inv_dir
+    ray->negative[k] = std::signbit(dir[k]) ? 1 : 0;
+  }
+}
+
+// Slab test of ray against 4 children. Returns mask of hit children
+// Slabs are ordered by ray direction so that inverted (empty) bounds are
+// never hit
+inline int IntersectChildren(const BvhNode& node, const Ray4& ray,
+                             float min_t, float max_t, Float4* t_near) {
+  Float4 near = Set4(min_t);
+  Float4 far = Set4(max_t);
+  for (int k = 0; k < 3; k++) {
+    const float* near_plane = ray.negative[k] ? node.bb_max[k] : node.bb_min[k];
+    const float* far_plane = ray.negative[k] ? node.bb_min[k] : node.bb_max[k];
+    near = Max4((Load4(near_plane) - ray.org[k]) * ray.inv_dir[k], near);
+    far = Min4((Load4(far_plane) - ray.org[k]) * ray.inv_dir[k], far);
+  }
+  *t_near = near;
+  return LessEqual4(near, far);
+}
+
+// Moller-Trumbore intersection of ray against 4 triangles of leaf
+// Updates max_t and hit if nearer hit is found
+inline bool IntersectLeaf(const BvhLeaf& leaf, const Ray4& ray, float min_t,
+                          float* max_t, RayHit* hit) {
+  const Float4 e1[3] = {Load4(leaf.e1[0]), Load4(leaf.e1[1]),
+                        Load4(leaf.e1[2])};
+  const Float4 e2[3] = {Load4(leaf.e2[0]), Load4(leaf.e2[1]),
+                        Load4(leaf.e2[2])};
+  const Float4* d = ray.dir;
+  const Float4 p[3] = {d[1] * e2[2] - d[2] * e2[1],
+                       d[2] * e2[0] - d[0] * e2[2],
+                       d[0] * e2[1] - d[1] * e2[0]};
+  const Float4 det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+  const Float4 inv_det = Set4(1.0f) / det;
+  const Float4 s[3] = {ray.org[0] - Load4(leaf.v0[0]),
+                       ray.org[1] - Load4(leaf.v0[1]),
+                       ray.org[2] - Load4(leaf.v0[2])};
+  const Float4 u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+  const Float4 q[3] = {s[1] * e1[2] - s[2] * e1[1],
+                       s[2] * e1[0] - s[0] * e1[2],
+                       s[0] * e1[1] - s[1] * e1[0]};
+  const Float4 v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+  const Float4 t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+  const Float4 zero = Set4(0.0f);
+  int mask = NotEqual4(det, zero) & LessEqual4(zero, u) &
+             LessEqual4(zero, v) & LessEqual4(u + v, Set4(1.0f)) &
+             LessEqual4(Set4(min_t), t) & LessEqual4(t, Set4(*max_t));
+  if (mask == 0) {
+    return false;
+  }
+
+  float ts[4], us[4], vs[4];
+  Store4(ts, t);
+  Store4(us, u);
+  Store4(vs, v);
+  int nearest = -1;
+  for (int i = 0; i < 4; i++) {
+    if ((mask >> i & 1) && (nearest < 0 || ts[i] < ts[nearest])) {
+      nearest = i;
+    }
+  }
+  *max_t = ts[nearest];
+  hit->t = ts[nearest];
+  hit->u = us[nearest];
+  hit->v = vs[nearest];
+  hit->prim_id = leaf.prim_id[nearest];
+  return true;
+}
+
+// Pushes hit children to stack in far to near order so that near one is
+// popped first
+inline void PushChildren(const BvhNode& node, int mask, const float t_near[4],
+                         int32_t* stack, int* stack_size) {
+  int order[4];
+  int num = 0;
+  for (int i = 0; i < 4; i++) {
+    if (mask >> i & 1) {
+      int j = num++;
+      for (; j > 0 && t_near[order[j - 1]] < t_near[i]; j--) {
+        order[j] = order[j - 1];
+      }
+      order[j] = i;
+    }
+  }
+  assert(*stack_size + num <= kMaxStackSize);
+  for (int i = 0; i < num; i++) {
+    stack[(*stack_size)++] = node.child[order[i]];
+  }
+}
+
+// Ray4 of each ray of packet. Inactive ray has empty range
+inline void MakePacketRays(const RayPacket& packet, Ray4 rays[kRayPacketSize],
+                           bool active[kRayPacketSize]) {
+  for (int j = 0; j < kRayPacketSize; j++) {
+    const float org[3] = {packet.org[0][j], packet.org[1][j], packet.org[2][j]};
+    const float dir[3] = {packet.dir[0][j], packet.dir[1][j], packet.dir[2][j]};
+    MakeRay4(org, dir, &rays[j]);
+    active[j] = packet.min_t[j] <= packet.max_t[j];
+  }
+}
+
+// Traverses nodes from root with rays of packet and calls
+// intersect_leaf(leaf index) for leaves hit by any ray. intersect_leaf updates
+// max_t of packet by hits and may deactivate rays. Traversal stops if it
+// returns false
+// A child is visited if any ray hits it. Children are ordered by the nearest
+// entry among rays
+template <typename IntersectLeafFunc>
+void TraversePacket(const BvhNode* nodes, const Ray4 rays[kRayPacketSize],
+                    const bool active[kRayPacketSize], const RayPacket& packet,
+                    IntersectLeafFunc intersect_leaf) {
+  int32_t stack[kMaxStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const int32_t current = stack[--stack_size];
+    if (current < 0) {
+      if (!intersect_leaf(~current)) {
+        return;
+      }
+      continue;
+    }
+
+    const BvhNode& node = nodes[current];
+    int mask = 0;
+    float t_near_min[4] = {kInf, kInf, kInf, kInf};
+    for (int j = 0; j < kRayPacketSize; j++) {
+      if (!active[j]) {
+        continue;
+      }
+      Float4 t_near;
+      const int ray_mask = IntersectChildren(node, rays[j], packet.min_t[j],
+                                             packet.max_t[j], &t_near);
+      if (ray_mask == 0) {
+        continue;
+      }
+      float t_near_array[4];
+      Store4(t_near_array, t_near);
+      for (int i = 0; i < 4; i++) {
+        if (ray_mask >> i & 1) {
+          t_near_min[i] = std::min(t_near_min[i], t_near_array[i]);
+        }
+      }
+      mask |= ray_mask;
+    }
+    PushChildren(node, mask, t_near_min, stack, &stack_size);
+  }
+}
+
+// Binary file layout: header, padding up to kBvhFileDataOffset, nodes and
+// leaves. Version should be incremented if layout of them is changed
+const char kBvhFileMagic[8] = {'C', 'R', 'B', 'V', 'H', '\0', '\0', '\0'};
+const uint32_t kBvhFileVersion = 3;
+const uint32_t kByteOrderMark = 0x01020304u;
+const size_t kBvhFileDataOffset = 128;
+
+struct BvhFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t key;
+  uint32_t node_size;
+  uint32_t leaf_size;
+  int32_t num_nodes;
+  int32_t num_leaves;
+  int32_t num_prims;
+  int32_t max_depth;
+  float sah_cost;
+  float bb_min[3];
+  float bb_max[3];
+};
+static_assert(sizeof(BvhFileHeader) <= kBvhFileDataOffset,
+              "header must fit before data");
+
+struct Aabb {
+  Eigen::Vector3f min{kInf, kInf, kInf};
+  Eigen::Vector3f max{-kInf, -kInf, -kInf};
+
+  void Extend(const Eigen::Vector3f& p) {
+    min = min.cwiseMin(p);
+    max = max.cwiseMax(p);
+  }
+  void Extend(const Aabb& b) {
+    min = min.cwiseMin(b.min);
+    max = max.cwiseMax(b.max);
+  }
+  float HalfArea() const {
+    if (min[0] > max[0]) {
+      return 0.0f;
+    }
+    const Eigen::Vector3f d = max - min;
+    return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+  }
+};
+
+// Bounds of i-th child of node
+inline Aabb ChildBounds(const BvhNode& node, int i) {
+  Aabb bounds;
+  for (int k = 0; k < 3; k++) {
+    bounds.min[k] = node.bb_min[k][i];
+    bounds.max[k] = node.bb_max[k][i];
+  }
+  return bounds;
+}
+
+inline void SetChildBounds(const Aabb& bounds, int i, BvhNode* node) {
+  for (int k = 0; k < 3; k++) {
+    node->bb_min[k][i] = bounds.min[k];
+    node->bb_max[k][i] = bounds.max[k];
+  }
+}
+
+inline Aabb NodeBounds(const BvhNode& node) {
+  Aabb bounds;
+  for (int i = 0; i < 4; i++) {
+    bounds.Extend(ChildBounds(node, i));
+  }
+  return bounds;
+}
+
+// SAH costs of testing 4 boxes of a node and 4 triangles of a leaf with SIMD
+const float kNodeCost = 1.0f;
+const float kLeafCost = 2.0f;
+
+// Sum of area weighted costs of all children over root area
+float SahCost(const BvhNode* nodes, int num_nodes) {
+  double cost = 0.0;
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for reduction(+ : cost)
+#endif
+  for (int j = 0; j < num_nodes; j++) {
+    for (int i = 0; i < 4; i++) {
+      cost += ChildBounds(nodes[j], i).HalfArea() *
+              (nodes[j].child[i] < 0 ? kLeafCost : kNodeCost);
+    }
+  }
+  const float root_area = NodeBounds(nodes[0]).HalfArea();
+  if (root_area <= 0.0f) {
+    return 0.0f;
+  }
+  return kNodeCost + static_cast<float>(cost / root_area);
+}
+
+// Shared by all threads of build
+struct BuildInput {
+  const currender::VertexView* vertices;
+  const currender::FaceView* faces;
+  std::vector<Aabb> prim_bounds;
+  std::vector<Eigen::Vector3f> centroids;
+  std::vector<int> prims;  // partitioned in place by disjoint ranges
+  currender::BvhQuality quality;
+  int leaf_size;
+  int bin_size;
+};
+
+struct Range {
+  int begin;
+  int end;
+  int size() const { return end - begin; }
+};
+
+// Subtree deferred to be built in parallel. Its root is set to the slot of
+// parent node after build
+struct Subtree {
+  int32_t parent;
+  int slot;
+  Range range;
+  int depth;
+};
+
+// State of a builder thread
+struct BuildContext {
+  BuildInput* input;
+  std::vector<BvhNode>* nodes;
+  std::vector<BvhLeaf>* leaves;
+  BvhStats* stats;
+  // ranges not larger than subtree_size are deferred if subtrees is not null
+  std::vector<Subtree>* subtrees{nullptr};
+  int subtree_size{0};
+  // scratch for binning
+  std::vector<Aabb> bins;
+  std::vector<int> counts;
+  std::vector<float> right_costs;
+};
+
+// Ranges larger than this are processed in parallel in top levels of tree
+const int kParallelRangeSize = 1 << 16;
+const int kMaxBinSize = 256;
+
+// Bounds of primitives and/or their centroids in range
+void RangeBounds(const BuildInput& input, const Range& range, Aabb* bounds,
+                 Aabb* centroid_bounds) {
+  const int* prims = input.prims.data();
+  if (range.size() <= kParallelRangeSize) {
+    for (int i = range.begin; i < range.end; i++) {
+      if (bounds != nullptr) {
+        bounds->Extend(input.prim_bounds[prims[i]]);
+      }
+      if (centroid_bounds != nullptr) {
+        centroid_bounds->Extend(input.centroids[prims[i]]);
+      }
+    }
+    return;
+  }
+
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel
+#endif
+  {
+    Aabb local_bounds, local_centroid_bounds;
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp for nowait
+#endif
+    for (int i = range.begin; i < range.end; i++) {
+      if (bounds != nullptr) {
+        local_bounds.Extend(input.prim_bounds[prims[i]]);
+      }
+      if (centroid_bounds != nullptr) {
+        local_centroid_bounds.Extend(input.centroids[prims[i]]);
+      }
+    }
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp critical
+#endif
+    {
+      if (bounds != nullptr) {
+        bounds->Extend(local_bounds);
+      }
+      if (centroid_bounds != nullptr) {
+        centroid_bounds->Extend(local_centroid_bounds);
+      }
+    }
+  }
+}
+
+// Bin of centroid along axis
+inline int BinIndex(const BuildInput& input, int prim, int axis, float origin,
+                    float scale) {
+  const int b =
+      static_cast<int>((input.centroids[prim][axis] - origin) * scale);
+  return std::min(std::max(b, 0), input.bin_size - 1);
+}
+
+// Bins primitives in range by centroid along axis
+void BinRange(const BuildInput& input, const Range& range, int axis,
+              float origin, float scale, Aabb* bins, int* counts) {
+  const int* prims = input.prims.data();
+  if (range.size() <= kParallelRangeSize) {
+    for (int i = range.begin; i < range.end; i++) {
+      const int b = BinIndex(input, prims[i], axis, origin, scale);
+      bins[b].Extend(input.prim_bounds[prims[i]]);
+      counts[b]++;
+    }
+    return;
+  }
+
+  // thread local bins are merged at the end
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel
+#endif
+  {
+    Aabb local_bins[kMaxBinSize];
+    int local_counts[kMaxBinSize] = {0};
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp for nowait
+#endif
+    for (int i = range.begin; i < range.end; i++) {
+      const int b = BinIndex(input, prims[i], axis, origin, scale);
+      local_bins[b].Extend(input.prim_bounds[prims[i]]);
+      local_counts[b]++;
+    }
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp critical
+#endif
+    for (int b = 0; b < input.bin_size; b++) {
+      bins[b].Extend(local_bins[b]);
+      counts[b] += local_counts[b];
+    }
+  }
+}
+
+// Splits range of primitives into two and returns the middle
+// Plane is at the spatial median for BvhQuality::kFast and chosen by binned
+// SAH otherwise
+int Split(BuildContext* ctx, const Range& range, int depth) {
+  const BuildInput& input = *ctx->input;
+  Aabb centroid_bounds;
+  RangeBounds(input, range, nullptr, &centroid_bounds);
+  const Eigen::Vector3f extent = centroid_bounds.max - centroid_bounds.min;
+  int axis = 0;
+  extent.maxCoeff(&axis);
+  int* prims = ctx->input->prims.data();
+  const Eigen::Vector3f* centroids = input.centroids.data();
+  if (extent[axis] <= 0.0f || depth >= kMaxSahDepth) {
+    const int mid = range.begin + range.size() / 2;
+    std::nth_element(
+        prims + range.begin, prims + mid, prims + range.end,
+        [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+    return mid;
+  }
+
+  // 2 bins split at the median of centroid bounds
+  int best_axis = axis;
+  int best_bin = 1;
+  float best_scale = 2.0f / extent[axis];
+  if (input.quality != currender::BvhQuality::kFast) {
+    const int bin_size = input.bin_size;
+    Aabb* bins = ctx->bins.data();
+    int* counts = ctx->counts.data();
+    float* right_costs = ctx->right_costs.data();
+    float best_cost = kInf;
+    best_bin = -1;
+    for (int k = 0; k < 3; k++) {
+      // only the longest axis for kMedium
+      if (extent[k] <= 0.0f ||
+          (input.quality == currender::BvhQuality::kMedium && k != axis)) {
+        continue;
+      }
+      const float origin = centroid_bounds.min[k];
+      const float scale = bin_size / extent[k];
+      std::fill(bins, bins + bin_size, Aabb());
+      std::fill(counts, counts + bin_size, 0);
+      BinRange(input, range, k, origin, scale, bins, counts);
+
+      // sweep from right to get costs of right sides, then from left
+      Aabb right;
+      int right_count = 0;
+      for (int b = bin_size - 1; b > 0; b--) {
+        right.Extend(bins[b]);
+        right_count += counts[b];
+        right_costs[b] = right.HalfArea() * right_count;
+      }
+      Aabb left;
+      int left_count = 0;
+      for (int b = 1; b < bin_size; b++) {
+        left.Extend(bins[b - 1]);
+        left_count += counts[b - 1];
+        if (left_count == 0 || left_count == range.size()) {
+          continue;
+        }
+        const float cost = left.HalfArea() * left_count + right_costs[b];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = k;
+          best_bin = b;
+          best_scale = scale;
+        }
+      }
+    }
+    assert(best_bin > 0);
+  }
+
+  const float origin = centroid_bounds.min[best_axis];
+  return static_cast<int>(
+      std::partition(prims + range.begin, prims + range.end,
+                     [&](int prim) {
+                       return BinIndex(input, prim, best_axis, origin,
+                                       best_scale) < best_bin;
+                     }) -
+      prims);
+}
+
+int32_t MakeLeaf(BuildContext* ctx, const Range& range) {
+  const BuildInput& input = *ctx->input;
+  BvhLeaf leaf;
+  for (int i = 0; i < 4; i++) {
+    Eigen::Vector3f v0 = Eigen::Vector3f::Zero();
+    Eigen::Vector3f e1 = Eigen::Vector3f::Zero();
+    Eigen::Vector3f e2 = Eigen::Vector3f::Zero();
+    leaf.prim_id[i] = -1;
+    if (i < range.size()) {
+      const int prim = input.prims[range.begin + i];
+      const Eigen::Vector3i face = (*input.faces)[prim];
+      v0 = (*input.vertices)[face[0]];
+      e1 = (*input.vertices)[face[1]] - v0;
+      e2 = (*input.vertices)[face[2]] - v0;
+      leaf.prim_id[i] = prim;
+    }
+    for (int k = 0; k < 3; k++) {
+      leaf.v0[k][i] = v0[k];
+      leaf.e1[k][i] = e1[k];
+      leaf.e2[k][i] = e2[k];
+    }
+  }
+  ctx->leaves->push_back(leaf);
+  ctx->stats->num_leaves++;
+  return static_cast<int32_t>(ctx->leaves->size() - 1);
+}
+
+// Makes node by splitting range up to 4 children and recursively builds them
+int32_t BuildNode(BuildContext* ctx, const Range& range, int depth) {
+  const int leaf_size = ctx->input->leaf_size;
+  const int32_t index = static_cast<int32_t>(ctx->nodes->size());
+  ctx->nodes->push_back(BvhNode());
+  ctx->stats->num_nodes++;
+  ctx->stats->max_depth = std::max(ctx->stats->max_depth, depth);
+
+  Range ranges[4] = {range};
+  int num = 1;
+  while (num < 4) {
+    // split the largest child which can not be a leaf
+    int largest = -1;
+    for (int i = 0; i < num; i++) {
+      if (ranges[i].size() > leaf_size &&
+          (largest < 0 || ranges[i].size() > ranges[largest].size())) {
+        largest = i;
+      }
+    }
+    if (largest < 0) {
+      break;
+    }
+    const int mid = Split(ctx, ranges[largest], depth);
+    ranges[num++] = {mid, ranges[largest].end};
+    ranges[largest].end = mid;
+  }
+
+  BvhNode node;
+  for (int i = 0; i < 4; i++) {
+    Aabb bounds;
+    node.child[i] = 0;
+    if (i < num) {
+      RangeBounds(*ctx->input, ranges[i], &bounds, nullptr);
+      if (ranges[i].size() <= leaf_size) {
+        node.child[i] = ~MakeLeaf(ctx, ranges[i]);
+      } else if (ctx->subtrees != nullptr &&
+                 ranges[i].size() <= ctx->subtree_size) {
+        ctx->subtrees->push_back({index, i, ranges[i], depth + 1});
+      } else {
+        node.child[i] = BuildNode(ctx, ranges[i], depth + 1);
+      }
+    }
+    SetChildBounds(bounds, i, &node);
+  }
+  (*ctx->nodes)[index] = node;
+
+  return index;
+}
+
+void InitBuildContext(BuildInput* input, std::vector<BvhNode>* nodes,
+                      std::vector<BvhLeaf>* leaves, BvhStats* stats,
+                      BuildContext* ctx) {
+  ctx->input = input;
+  ctx->nodes = nodes;
+  ctx->leaves = leaves;
+  ctx->stats = stats;
+  ctx->bins.resize(input->bin_size);
+  ctx->counts.resize(input->bin_size);
+  ctx->right_costs.resize(input->bin_size);
+}
+
+// Makes top-level node over instances in range by object median split up to
+// 4 children. A child with one instance is a leaf
+int32_t BuildTopLevelNode(const std::vector<Aabb>& bounds,
+                          const std::vector<Eigen::Vector3f>& centroids,
+                          const Range& range, int depth, std::vector<int>* ids,
+                          std::vector<BvhNode>* nodes, BvhStats* stats) {
+  const int32_t index = static_cast<int32_t>(nodes->size());
+  nodes->push_back(BvhNode());
+  stats->num_nodes++;
+  stats->max_depth = std::max(stats->max_depth, depth);
+
+  Range ranges[4] = {range};
+  int num = 1;
+  while (num < 4) {
+    int largest = 0;
+    for (int i = 1; i < num; i++) {
+      if (ranges[i].size() > ranges[largest].size()) {
+        largest = i;
+      }
+    }
+    if (ranges[largest].size() <= 1) {
+      break;
+    }
+    Aabb centroid_bounds;
+    for (int i = ranges[largest].begin; i < ranges[largest].end; i++) {
+      centroid_bounds.Extend(centroids[(*ids)[i]]);
+    }
+    int axis = 0;
+    (centroid_bounds.max - centroid_bounds.min).maxCoeff(&axis);
+    const int mid = ranges[largest].begin + ranges[largest].size() / 2;
+    std::nth_element(ids->begin() + ranges[largest].begin,
+                     ids->begin() + mid, ids->begin() + ranges[largest].end,
+                     [&](int a, int b) {
+                       return centroids[a][axis] < centroids[b][axis];
+                     });
+    ranges[num++] = {mid, ranges[largest].end};
+    ranges[largest].end = mid;
+  }
+
+  BvhNode node;
+  for (int i = 0; i < 4; i++) {
+    Aabb child_bounds;
+    node.child[i] = 0;
+    if (i < num) {
+      for (int j = ranges[i].begin; j < ranges[i].end; j++) {
+        child_bounds.Extend(bounds[(*ids)[j]]);
+      }
+      if (ranges[i].size() == 1) {
+        node.child[i] = ~(*ids)[ranges[i].begin];
+        stats->num_leaves++;
+      } else {
+        node.child[i] = BuildTopLevelNode(bounds, centroids, ranges[i],
+                                          depth + 1, ids, nodes, stats);
+      }
+    }
+    SetChildBounds(child_bounds, i, &node);
+  }
+  (*nodes)[index] = node;
+
+  return index;
+}
+
+}  // namespace
+
+namespace currender {
+
+Bvh::Bvh() { Clear(); }
+Bvh::~Bvh() {}
+
+bool Bvh::Build(const VertexView& vertices, const FaceView& faces,
+                const BvhBuildOption& option) {
+  Clear();
+  if (faces.empty()) {
+    LOGE("no face to build BVH\n");
+    return false;
+  }
+
+  Timer<> timer;
+  timer.Start();
+
+  BuildInput input;
+  input.vertices = &vertices;
+  input.faces = &faces;
+  input.quality = option.quality;
+  input.leaf_size = std::min(std::max(option.min_leaf_primitives, 1), 4);
+  input.bin_size = std::min(std::max(option.bin_size, 2), kMaxBinSize);
+  const int num_faces = static_cast<int>(faces.size());
+  const int num_vertices = static_cast<int>(vertices.size());
+  input.prim_bounds.resize(num_faces);
+  input.centroids.resize(num_faces);
+  input.prims.resize(num_faces);
+  int invalid_face = num_faces;
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < num_faces; i++) {
+    const Eigen::Vector3i face = faces[i];
+    if (face.minCoeff() < 0 || face.maxCoeff() >= num_vertices) {
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp critical
+#endif
+      invalid_face = std::min(invalid_face, i);
+      continue;
+    }
+    Aabb& bounds = input.prim_bounds[i];
+    for (int j = 0; j < 3; j++) {
+      bounds.Extend(vertices[face[j]]);
+    }
+    input.centroids[i] = (bounds.min + bounds.max) * 0.5f;
+    input.prims[i] = i;
+  }
+  if (invalid_face < num_faces) {
+    LOGE("%d th face has invalid vertex index\n", invalid_face);
+    return false;
+  }
+
+  // top levels are built serially while small ranges are deferred as
+  // subtrees. Large ranges in top levels are binned in parallel instead
+  std::vector<Subtree> subtrees;
+  BuildContext ctx;
+  InitBuildContext(&input, &node_storage_, &leaf_storage_, &stats_, &ctx);
+  ctx.subtrees = &subtrees;
+  ctx.subtree_size = std::max(num_faces / 128, 4096);
+  node_storage_.reserve(num_faces / 2);
+  leaf_storage_.reserve(num_faces / 2);
+  // root is always a node even if faces fit in a leaf
+  BuildNode(&ctx, {0, num_faces}, 0);
+
+  // subtrees are built in parallel with their own storage since ranges of
+  // primitives are disjoint
+  const int num_subtrees = static_cast<int>(subtrees.size());
+  std::vector<std::vector<BvhNode>> subtree_nodes(num_subtrees);
+  std::vector<std::vector<BvhLeaf>> subtree_leaves(num_subtrees);
+  std::vector<BvhStats> subtree_stats(num_subtrees);
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (int j = 0; j < num_subtrees; j++) {
+    BuildContext subtree_ctx;
+    InitBuildContext(&input, &subtree_nodes[j], &subtree_leaves[j],
+                     &subtree_stats[j], &subtree_ctx);
+    BuildNode(&subtree_ctx, subtrees[j].range, subtrees[j].depth);
+  }
+
+  // append subtrees after top levels. A child is still after its parent
+  for (int j = 0; j < num_subtrees; j++) {
+    const int32_t node_offset = static_cast<int32_t>(node_storage_.size());
+    const int32_t leaf_offset = static_cast<int32_t>(leaf_storage_.size());
+    for (BvhNode& node : subtree_nodes[j]) {
+      for (int i = 0; i < 4; i++) {
+        if (node.child[i] > 0) {
+          node.child[i] += node_offset;
+        } else if (node.child[i] < 0) {
+          node.child[i] = ~(~node.child[i] + leaf_offset);
+        }
+      }
+    }
+    node_storage_.insert(node_storage_.end(), subtree_nodes[j].begin(),
+                         subtree_nodes[j].end());
+    leaf_storage_.insert(leaf_storage_.end(), subtree_leaves[j].begin(),
+                         subtree_leaves[j].end());
+    node_storage_[subtrees[j].parent].child[subtrees[j].slot] = node_offset;
+    stats_.num_nodes += subtree_stats[j].num_nodes;
+    stats_.num_leaves += subtree_stats[j].num_leaves;
+    stats_.max_depth = std::max(stats_.max_depth, subtree_stats[j].max_depth);
+    std::vector<BvhNode>().swap(subtree_nodes[j]);
+    std::vector<BvhLeaf>().swap(subtree_leaves[j]);
+  }
+  nodes_ = node_storage_.data();
+  leaves_ = leaf_storage_.data();
+  num_nodes_ = static_cast<int>(node_storage_.size());
+  num_leaves_ = static_cast<int>(leaf_storage_.size());
+  num_prims_ = num_faces;
+
+  const Aabb bounds = NodeBounds(nodes_[0]);
+  bb_min_ = bounds.min;
+  bb_max_ = bounds.max;
+
+  timer.End();
+  stats_.build_msec = timer.elapsed_msec();
+  stats_.sah_cost = SahCost(nodes_, num_nodes_);
+
+  return true;
+}
+
+void Bvh::Clear() {
+  node_storage_.clear();
+  leaf_storage_.clear();
+  mapped_file_.reset();
+  nodes_ = nullptr;
+  leaves_ = nullptr;
+  num_nodes_ = 0;
+  num_leaves_ = 0;
+  num_prims_ = 0;
+  stats_ = BvhStats();
+  bb_min_.setZero();
+  bb_max_.setZero();
+}
+
+bool Bvh::empty() const { return num_nodes_ == 0; }
+
+bool Bvh::Refit(const VertexView& vertices, const FaceView& faces) {
+  if (empty()) {
+    LOGE("BVH has not been built\n");
+    return false;
+  }
+  if (static_cast<int>(faces.size()) != num_prims_) {
+    LOGE("# of faces %d is different from BVH %d\n",
+         static_cast<int>(faces.size()), num_prims_);
+    return false;
+  }
+
+  // mapped BVH is copied to be modified
+  if (mapped_file_ != nullptr) {
+    node_storage_.assign(nodes_, nodes_ + num_nodes_);
+    leaf_storage_.assign(leaves_, leaves_ + num_leaves_);
+    mapped_file_.reset();
+    nodes_ = node_storage_.data();
+    leaves_ = leaf_storage_.data();
+  }
+
+  const int num_leaves = num_leaves_;
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for
+#endif
+  for (int j = 0; j < num_leaves; j++) {
+    BvhLeaf& leaf = leaf_storage_[j];
+    for (int i = 0; i < 4; i++) {
+      if (leaf.prim_id[i] < 0) {
+        continue;
+      }
+      const Eigen::Vector3i face = faces[leaf.prim_id[i]];
+      const Eigen::Vector3f v0 = vertices[face[0]];
+      const Eigen::Vector3f e1 = vertices[face[1]] - v0;
+      const Eigen::Vector3f e2 = vertices[face[2]] - v0;
+      for (int k = 0; k < 3; k++) {
+        leaf.v0[k][i] = v0[k];
+        leaf.e1[k][i] = e1[k];
+        leaf.e2[k][i] = e2[k];
+      }
+    }
+  }
+
+  // nodes are in depth-first order so that a child is after its parent
+  // nodes of the same depth are refitted in parallel from the deepest
+  std::vector<int> depths(num_nodes_, 0);
+  std::vector<std::vector<int>> levels;
+  for (int j = 0; j < num_nodes_; j++) {
+    if (depths[j] >= static_cast<int>(levels.size())) {
+      levels.resize(depths[j] + 1);
+    }
+    levels[depths[j]].push_back(j);
+    for (int i = 0; i < 4; i++) {
+      if (node_storage_[j].child[i] > 0) {
+        depths[node_storage_[j].child[i]] = depths[j] + 1;
+      }
+    }
+  }
+  for (int d = static_cast<int>(levels.size()) - 1; d >= 0; d--) {
+    const std::vector<int>& level = levels[d];
+    const int level_size = static_cast<int>(level.size());
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for
+#endif
+    for (int j = 0; j < level_size; j++) {
+      BvhNode& node = node_storage_[level[j]];
+      for (int i = 0; i < 4; i++) {
+        const int32_t child = node.child[i];
+        if (child == 0) {
+          continue;
+        }
+        Aabb bounds;
+        if (child < 0) {
+          const BvhLeaf& leaf = leaf_storage_[~child];
+          for (int t = 0; t < 4; t++) {
+            if (leaf.prim_id[t] >= 0) {
+              const Eigen::Vector3i face = faces[leaf.prim_id[t]];
+              for (int v = 0; v < 3; v++) {
+                bounds.Extend(vertices[face[v]]);
+              }
+            }
+          }
+        } else {
+          bounds = NodeBounds(node_storage_[child]);
+        }
+        SetChildBounds(bounds, i, &node);
+      }
+    }
+  }
+
+  const Aabb bounds = NodeBounds(nodes_[0]);
+  bb_min_ = bounds.min;
+  bb_max_ = bounds.max;
+  stats_.sah_cost = SahCost(nodes_, num_nodes_);
+
+  return true;
+}
+
+bool Bvh::Save(const std::string& path, uint64_t key) const {
+  if (empty()) {
+    LOGE("BVH is empty\n");
+    return false;
+  }
+
+  BvhFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kBvhFileMagic, sizeof(kBvhFileMagic));
+  header.version = kBvhFileVersion;
+  header.byte_order = kByteOrderMark;
+  header.key = key;
+  header.node_size = sizeof(BvhNode);
+  header.leaf_size = sizeof(BvhLeaf);
+  header.num_nodes = num_nodes_;
+  header.num_leaves = num_leaves_;
+  header.num_prims = num_prims_;
+  header.max_depth = stats_.max_depth;
+  header.sah_cost = stats_.sah_cost;
+  for (int k = 0; k < 3; k++) {
+    header.bb_min[k] = bb_min_[k];
+    header.bb_max[k] = bb_max_[k];
+  }
+
+  // write to temporary file and rename it not to expose incomplete file to
+  // other processes loading the same path
+  const std::string tmp_path =
+      path + "." + std::to_string(std::random_device()()) + ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary);
+    if (!ofs.is_open()) {
+      LOGE("failed to open %s\n", tmp_path.c_str());
+      return false;
+    }
+    char padding[kBvhFileDataOffset] = {0};
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(padding, kBvhFileDataOffset - sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(nodes_),
+              sizeof(BvhNode) * num_nodes_);
+    ofs.write(reinterpret_cast<const char*>(leaves_),
+              sizeof(BvhLeaf) * num_leaves_);
+    if (!ofs.good()) {
+      LOGE("failed to write %s\n", tmp_path.c_str());
+      ofs.close();
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    // may fail if another process has just saved it
+    std::remove(tmp_path.c_str());
+    return std::ifstream(path).is_open();
+  }
+
+  return true;
+}
+
+bool Bvh::Load(const std::string& path, uint64_t key) {
+  Clear();
+
+  std::unique_ptr<MappedFile> file(new MappedFile);
+  if (!file->Open(path)) {
+    return false;
+  }
+  if (file->size() < kBvhFileDataOffset) {
+    LOGW("%s is too small as BVH file\n", path.c_str());
+    return false;
+  }
+  BvhFileHeader header;
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (std::memcmp(header.magic, kBvhFileMagic, sizeof(kBvhFileMagic)) != 0 ||
+      header.version != kBvhFileVersion ||
+      header.byte_order != kByteOrderMark ||
+      header.node_size != sizeof(BvhNode) ||
+      header.leaf_size != sizeof(BvhLeaf)) {
+    LOGW("%s is not compatible BVH file\n", path.c_str());
+    return false;
+  }
+  if (header.key != key) {
+    LOGW("key of %s is different\n", path.c_str());
+    return false;
+  }
+  if (header.num_nodes <= 0 || header.num_leaves < 0 || header.num_prims < 0 ||
+      file->size() != kBvhFileDataOffset +
+                          sizeof(BvhNode) * header.num_nodes +
+                          sizeof(BvhLeaf) * header.num_leaves) {
+    LOGW("size of %s is wrong\n", path.c_str());
+    return false;
+  }
+  // a node of depth d leaves at most 3 * d + 4 entries on traversal stack
+  if (header.max_depth < 0 || header.max_depth > (kMaxStackSize - 4) / 3) {
+    LOGW("%s is too deep to traverse\n", path.c_str());
+    return false;
+  }
+
+  const BvhNode* nodes =
+      reinterpret_cast<const BvhNode*>(file->data() + kBvhFileDataOffset);
+  const BvhLeaf* leaves =
+      reinterpret_cast<const BvhLeaf*>(nodes + header.num_nodes);
+  // nodes are in depth-first order so that a child is after its parent and
+  // depth of a node is fixed before its children are visited. This rejects
+  // cycles and trees deeper than the header says. Child 0 is an unused slot
+  // and must have empty bounds not to be traversed
+  std::vector<int> depths(header.num_nodes, 0);
+  for (int i = 0; i < header.num_nodes; i++) {
+    for (int j = 0; j < 4; j++) {
+      const int32_t child = nodes[i].child[j];
+      bool unused = child == 0;
+      for (int k = 0; unused && k < 3; k++) {
+        unused = nodes[i].bb_min[k][j] == kInf &&
+                 nodes[i].bb_max[k][j] == -kInf;
+      }
+      if (child >= header.num_nodes || ~child >= header.num_leaves ||
+          (child >= 0 && child <= i && !unused)) {
+        LOGW("%s has broken node\n", path.c_str());
+        return false;
+      }
+      if (child > 0) {
+        depths[child] = std::max(depths[child], depths[i] + 1);
+        if (depths[child] > header.max_depth) {
+          LOGW("%s has broken node\n", path.c_str());
+          return false;
+        }
+      }
+    }
+  }
+  // prim_id indexes faces in Refit() and shading. -1 is padding
+  for (int i = 0; i < header.num_leaves; i++) {
+    for (int j = 0; j < 4; j++) {
+      const int32_t prim_id = leaves[i].prim_id[j];
+      if (prim_id < -1 || prim_id >= header.num_prims) {
+        LOGW("%s has broken leaf\n", path.c_str());
+        return false;
+      }
+    }
+  }
+
+  mapped_file_ = std::move(file);
+  nodes_ = nodes;
+  leaves_ = leaves;
+  num_nodes_ = header.num_nodes;
+  num_leaves_ = header.num_leaves;
+  num_prims_ = header.num_prims;
+  stats_.sah_cost = header.sah_cost;
+  stats_.num_nodes = header.num_nodes;
+  stats_.num_leaves = header.num_leaves;
+  stats_.max_depth = header.max_depth;
+  for (int k = 0; k < 3; k++) {
+    bb_min_[k] = header.bb_min[k];
+    bb_max_[k] = header.bb_max[k];
+  }
+
+  return true;
+}
+
+bool Bvh::Intersect(const Eigen::Vector3f& org, const Eigen::Vector3f& dir,
+                    float min_t, float max_t, RayHit* hit) const {
+  if (empty() || !(min_t <= max_t)) {
+    return false;
+  }
+
+  Ray4 ray;
+  MakeRay4(org.data(), dir.data(), &ray);
+
+  bool is_hit = false;
+  int32_t stack[kMaxStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const int32_t current = stack[--stack_size];
+    if (current < 0) {
+      is_hit |= IntersectLeaf(leaves_[~current], ray, min_t, &max_t, hit);
+      continue;
+    }
+    const BvhNode& node = nodes_[current];
+    Float4 t_near;
+    const int mask = IntersectChildren(node, ray, min_t, max_t, &t_near);
+    float t_near_array[4];
+    Store4(t_near_array, t_near);
+    PushChildren(node, mask, t_near_array, stack, &stack_size);
+  }
+
+  return is_hit;
+}
+
+void Bvh::Intersect(RayPacket* packet) const {
+  for (int j = 0; j < kRayPacketSize; j++) {
+    packet->prim_id[j] = -1;
+  }
+  if (empty()) {
+    return;
+  }
+
+  Ray4 rays[kRayPacketSize];
+  bool active[kRayPacketSize];
+  MakePacketRays(*packet, rays, active);
+  TraversePacket(nodes_, rays, active, *packet, [&](int32_t leaf_index) {
+    const BvhLeaf& leaf = leaves_[leaf_index];
+    for (int j = 0; j < kRayPacketSize; j++) {
+      RayHit hit;
+      if (active[j] && IntersectLeaf(leaf, rays[j], packet->min_t[j],
+                                     &packet->max_t[j], &hit)) {
+        packet->u[j] = hit.u;
+        packet->v[j] = hit.v;
+        packet->prim_id[j] = hit.prim_id;
+      }
+    }
+    return true;
+  });
+}
+
+bool Bvh::Occluded(const Eigen::Vector3f& org, const Eigen::Vector3f& dir,
+                   float min_t, float max_t) const {
+  if (empty() || !(min_t <= max_t)) {
+    return false;
+  }
+
+  Ray4 ray;
+  MakeRay4(org.data(), dir.data(), &ray);
+
+  int32_t stack[kMaxStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const int32_t current = stack[--stack_size];
+    if (current < 0) {
+      RayHit hit;
+      if (IntersectLeaf(leaves_[~current], ray, min_t, &max_t, &hit)) {
+        return true;
+      }
+      continue;
+    }
+    const BvhNode& node = nodes_[current];
+    Float4 t_near;
+    const int mask = IntersectChildren(node, ray, min_t, max_t, &t_near);
+    float t_near_array[4];
+    Store4(t_near_array, t_near);
+    PushChildren(node, mask, t_near_array, stack, &stack_size);
+  }
+
+  return false;
+}
+
+void Bvh::Occluded(RayPacket* packet) const {
+  for (int j = 0; j < kRayPacketSize; j++) {
+    packet->prim_id[j] = -1;
+  }
+  if (empty()) {
+    return;
+  }
+
+  // ray is deactivated by its first hit and traversal ends when all rays are
+  Ray4 rays[kRayPacketSize];
+  bool active[kRayPacketSize];
+  MakePacketRays(*packet, rays, active);
+  int num_active = static_cast<int>(std::count(active, active + kRayPacketSize,
+                                               true));
+  if (num_active == 0) {
+    return;
+  }
+  TraversePacket(nodes_, rays, active, *packet, [&](int32_t leaf_index) {
+    const BvhLeaf& leaf = leaves_[leaf_index];
+    for (int j = 0; j < kRayPacketSize; j++) {
+      RayHit hit;
+      if (active[j] && IntersectLeaf(leaf, rays[j], packet->min_t[j],
+                                     &packet->max_t[j], &hit)) {
+        packet->u[j] = hit.u;
+        packet->v[j] = hit.v;
+        packet->prim_id[j] = hit.prim_id;
+        active[j] = false;
+        num_active--;
+      }
+    }
+    return num_active > 0;
+  });
+}
+
+int Bvh::num_prims() const { return num_prims_; }
+
+const BvhStats& Bvh::stats() const { return stats_; }
+
+const Eigen::Vector3f& Bvh::bb_min() const { return bb_min_; }
+
+const Eigen::Vector3f& Bvh::bb_max() const { return bb_max_; }
+
+TopLevelBvh::TopLevelBvh() {}
+TopLevelBvh::~TopLevelBvh() {}
+
+bool TopLevelBvh::Build(const std::vector<BvhInstance>& instances) {
+  Clear();
+  if (instances.empty()) {
+    LOGE("no instance to build top-level BVH\n");
+    return false;
+  }
+
+  Timer<> timer;
+  timer.Start();
+
+  const int num_instances = static_cast<int>(instances.size());
+  std::vector<Aabb> bounds(num_instances);
+  std::vector<Eigen::Vector3f> centroids(num_instances);
+  std::vector<int> ids(num_instances);
+  bvhs_.resize(num_instances);
+  w2o_linear_.resize(num_instances);
+  translation_.resize(num_instances);
+  for (int i = 0; i < num_instances; i++) {
+    const BvhInstance& instance = instances[i];
+    if (instance.bvh == nullptr || instance.bvh->empty()) {
+      LOGE("%d th instance has no BVH\n", i);
+      Clear();
+      return false;
+    }
+    if (std::abs(instance.linear.determinant()) <
+        std::numeric_limits<float>::min()) {
+      LOGE("%d th instance has singular transform\n", i);
+      Clear();
+      return false;
+    }
+    bvhs_[i] = instance.bvh;
+    w2o_linear_[i] = instance.linear.inverse();
+    translation_[i] = instance.translation;
+
+    // bounds of transformed corners of bottom-level bounds
+    const Eigen::Vector3f& bb_min = instance.bvh->bb_min();
+    const Eigen::Vector3f& bb_max = instance.bvh->bb_max();
+    for (int c = 0; c < 8; c++) {
+      const Eigen::Vector3f corner((c & 1) ? bb_max[0] : bb_min[0],
+                                   (c & 2) ? bb_max[1] : bb_min[1],
+                                   (c & 4) ? bb_max[2] : bb_min[2]);
+      bounds[i].Extend(instance.linear * corner + instance.translation);
+    }
+    centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+    ids[i] = i;
+  }
+
+  BuildTopLevelNode(bounds, centroids, {0, num_instances}, 0, &ids, &nodes_,
+                    &stats_);
+
+  timer.End();
+  stats_.build_msec = timer.elapsed_msec();
+  stats_.sah_cost =
+      SahCost(nodes_.data(), static_cast<int>(nodes_.size()));
+
+  return true;
+}
+
+void TopLevelBvh::Clear() {
+  nodes_.clear();
+  bvhs_.clear();
+  w2o_linear_.clear();
+  translation_.clear();
+  stats_ = BvhStats();
+}
+
+bool TopLevelBvh::empty() const { return nodes_.empty(); }
+
+void TopLevelBvh::Intersect(RayPacket* packet) const {
+  Traverse(packet, false);
+}
+
+void TopLevelBvh::Occluded(RayPacket* packet) const {
+  Traverse(packet, true);
+}
+
+void TopLevelBvh::Traverse(RayPacket* packet, bool any_hit) const {
+  for (int j = 0; j < kRayPacketSize; j++) {
+    packet->prim_id[j] = -1;
+    packet->instance_id[j] = -1;
+  }
+  if (empty()) {
+    return;
+  }
+
+  Ray4 rays[kRayPacketSize];
+  bool active[kRayPacketSize];
+  MakePacketRays(*packet, rays, active);
+  int num_active = static_cast<int>(std::count(active, active + kRayPacketSize,
+                                               true));
+  if (num_active == 0) {
+    return;
+  }
+  TraversePacket(nodes_.data(), rays, active, *packet, [&](int32_t instance) {
+    // ray parameter t is kept by affine transform without normalization
+    RayPacket local;
+    const Eigen::Matrix3f& linear = w2o_linear_[instance];
+    const Eigen::Vector3f& translation = translation_[instance];
+    for (int j = 0; j < kRayPacketSize; j++) {
+      const Eigen::Vector3f org(packet->org[0][j], packet->org[1][j],
+                                packet->org[2][j]);
+      const Eigen::Vector3f dir(packet->dir[0][j], packet->dir[1][j],
+                                packet->dir[2][j]);
+      const Eigen::Vector3f local_org = linear * (org - translation);
+      const Eigen::Vector3f local_dir = linear * dir;
+      for (int k = 0; k < 3; k++) {
+        local.org[k][j] = local_org[k];
+        local.dir[k][j] = local_dir[k];
+      }
+      local.min_t[j] = active[j] ? packet->min_t[j] : 1.0f;
+      local.max_t[j] = active[j] ? packet->max_t[j] : 0.0f;
+    }
+    if (any_hit) {
+      bvhs_[instance]->Occluded(&local);
+    } else {
+      bvhs_[instance]->Intersect(&local);
+    }
+    for (int j = 0; j < kRayPacketSize; j++) {
+      if (local.prim_id[j] >= 0) {
+        packet->max_t[j] = local.max_t[j];
+        packet->u[j] = local.u[j];
+        packet->v[j] = local.v[j];
+        packet->prim_id[j] = local.prim_id[j];
+        packet->instance_id[j] = instance;
+        if (any_hit) {
+          active[j] = false;
+          num_active--;
+        }
+      }
+    }
+    return num_active > 0;
+  });
+}
+
+const BvhStats& TopLevelBvh::stats() const { return stats_; }
+
+}  // namespace currender
+
+namespace {
+
+bool BuildMeshBvh(const currender::Mesh& mesh,
+                  const currender::BvhBuildOption& build_option,
+                  currender::Bvh* bvh) {
+  // BVH reads vertices and faces of mesh directly. Leaves have their own
+  // copy of triangles, so order of faces does not matter
+  if (!bvh->Build(mesh.vertices(), mesh.vertex_indices(), build_option)) {
+    LOGE("BVH building failed\n");
+    return false;
+  }
+
+  const BvhStats& stats = bvh->stats();
+  LOGI("  BVH build time: %.1f msecs\n", stats.build_msec);
+  LOGI("  BVH statistics:\n");
+  LOGI("    # of leaf   nodes: %d\n", stats.num_leaves);
+  LOGI("    # of branch nodes: %d\n", stats.num_nodes);
+  LOGI("  Max tree depth     : %d\n", stats.max_depth);
+  LOGI("  SAH cost           : %f\n", stats.sah_cost);
+  const Eigen::Vector3f& bmin = bvh->bb_min();
+  const Eigen::Vector3f& bmax = bvh->bb_max();
+  LOGI("  Bmin               : %f, %f, %f\n", bmin[0], bmin[1], bmin[2]);
+  LOGI("  Bmax               : %f, %f, %f\n", bmax[0], bmax[1], bmax[2]);
+
+  return true;
+}
+
+}  // namespace
+
+namespace currender {
+
+bool PrepareMeshBvh(const Mesh& mesh, const RendererOption& option,
+                    const BvhBuildOption& build_option, bool use_cache,
+                    Bvh* bvh) {
+  // BVH is memory-mapped from cache of the same mesh if exists
+  std::string cache_path;
+  uint64_t cache_key = 0;
+  if (use_cache && !option.bvh_cache_dir.empty()) {
+    const auto& vertices = mesh.vertices();
+    const auto& vertex_indices = mesh.vertex_indices();
+    // tree depends on options of build as well as mesh
+    const int build_params[3] = {static_cast<int>(build_option.quality),
+                                 build_option.min_leaf_primitives,
+                                 build_option.bin_size};
+    cache_key = HashBytes(build_params, sizeof(build_params));
+    cache_key = HashBytes(vertices.data(),
+                          sizeof(vertices[0]) * vertices.size(), cache_key);
+    cache_key = HashBytes(vertex_indices.data(),
+                          sizeof(vertex_indices[0]) * vertex_indices.size(),
+                          cache_key);
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh",
+                  static_cast<unsigned long long>(cache_key));
+    cache_path = option.bvh_cache_dir + "/" + name;
+
+    Timer<> timer;
+    timer.Start();
+    // face count is compared in case of hash collision
+    if (bvh->Load(cache_path, cache_key)) {
+      timer.End();
+      if (bvh->num_prims() ==
+          static_cast<int>(mesh.vertex_indices().size())) {
+        LOGI("  BVH loaded from %s: %.1f msecs\n", cache_path.c_str(),
+             timer.elapsed_msec());
+        return true;
+      }
+      LOGW("# of faces of %s is different from mesh\n", cache_path.c_str());
+      bvh->Clear();
+    }
+  }
+
+  if (!BuildMeshBvh(mesh, build_option, bvh)) {
+    return false;
+  }
+
+  if (!cache_path.empty() && !bvh->Save(cache_path, cache_key)) {
+    LOGW("failed to save BVH cache to %s\n", cache_path.c_str());
+  }
+
+  return true;
+}
+
+}  // namespace currender
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "currender/raytracer.h"
+#include "src/mapped_file.h"
+
+namespace currender {
+
+// # of rays traced together by Bvh::Intersect(RayPacket*)
+const int kRayPacketSize = 16;
+
+// Rays as structure of arrays. Inactive ray has empty range (min_t > max_t)
+// max_t is updated to the nearest hit
+struct RayPacket {
+  float org[3][kRayPacketSize];
+  float dir[3][kRayPacketSize];
+  float min_t[kRayPacketSize];
+  float max_t[kRayPacketSize];
+  float u[kRayPacketSize];
+  float v[kRayPacketSize];
+  int prim_id[kRayPacketSize];  // -1 if no hit
+  int instance_id[kRayPacketSize];  // set only by TopLevelBvh. -1 if no hit
+};
+
+struct RayHit {
+  float t{0.0f};
+  float u{0.0f};  // barycentric of 2nd vertex
+  float v{0.0f};  // barycentric of 3rd vertex
+  int prim_id{-1};
+};
+
+// Read-only view of 3 component elements (vertex positions or face indices)
+// with stride in bytes. Mesh storage is read without copy
+template <typename T>
+class StridedView {
+  const uint8_t* data_{nullptr};
+  size_t stride_{0};
+  size_t size_{0};
+
+ public:
+  StridedView() {}
+  StridedView(const T* data, size_t size, size_t stride = 3 * sizeof(T))
+      : data_(reinterpret_cast<const uint8_t*>(data)),
+        stride_(stride),
+        size_(size) {}
+  StridedView(const std::vector<Eigen::Matrix<T, 3, 1>>& elements)  // NOLINT
+      : StridedView(elements.empty() ? nullptr : elements[0].data(),
+                    elements.size(), sizeof(elements[0])) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  Eigen::Map<const Eigen::Matrix<T, 3, 1>> operator[](size_t i) const {
+    return Eigen::Map<const Eigen::Matrix<T, 3, 1>>(
+        reinterpret_cast<const T*>(data_ + stride_ * i));
+  }
+};
+typedef StridedView<float> VertexView;
+typedef StridedView<int> FaceView;
+
+// 4-wide node. Bounds of children are in structure of arrays to test a ray
+// against all of them at once with SIMD
+// Empty child has inverted bounds which no ray hits and index 0 (root can not
+// be a child)
+struct BvhNode {
+  float bb_min[3][4];
+  float bb_max[3][4];
+  int32_t child[4];  // node index if >= 0, ~(leaf index) otherwise
+};
+
+// Leaf of 4 triangles in structure of arrays, precomputed for Moller-Trumbore
+// intersection. Padding triangle is degenerate and has prim_id -1
+struct BvhLeaf {
+  float v0[3][4];
+  float e1[3][4];  // v1 - v0
+  float e2[3][4];  // v2 - v0
+  int32_t prim_id[4];
+};
+
+// Bounding volume hierarchy with 4-wide nodes over triangles
+// Both sides of triangles are hit
+// Nodes and leaves are owned by Bvh after Build() or memory-mapped from file
+// after Load()
+class Bvh {
+  std::vector<BvhNode> node_storage_;
+  std::vector<BvhLeaf> leaf_storage_;
+  std::unique_ptr<MappedFile> mapped_file_;
+  const BvhNode* nodes_{nullptr};
+  const BvhLeaf* leaves_{nullptr};
+  int num_nodes_{0};
+  int num_leaves_{0};
+  int num_prims_{0};
+  BvhStats stats_;
+  Eigen::Vector3f bb_min_, bb_max_;
+
+ public:
+  Bvh();
+  ~Bvh();
+
+  // Primitive id is index of faces
+  // Subtrees are built in parallel
+  bool Build(const VertexView& vertices, const FaceView& faces,
+             const BvhBuildOption& option = BvhBuildOption());
+  void Clear();
+  bool empty() const;
+
+  // Updates triangles and bounds for moved vertices with the same faces as
+  // Build(). Tree structure is kept and bounds are refitted bottom-up
+  // stats().sah_cost is updated to decide rebuild
+  // Fails if # of faces is different from num_prims()
+  bool Refit(const VertexView& vertices, const FaceView& faces);
+
+  // Binary file of nodes and leaves with key to identify the mesh (e.g. hash)
+  // Load() maps the file and fails if key or format is different, or if
+  // nodes or leaves are broken. prim_id of loaded leaves is in
+  // [-1, num_prims()), which caller should compare with its faces
+  bool Save(const std::string& path, uint64_t key) const;
+  bool Load(const std::string& path, uint64_t key);
+
+  // Nearest hit in [min_t, max_t] along ray. Returns false if no hit
+  bool Intersect(const Eigen::Vector3f& org, const Eigen::Vector3f& dir,
+                 float min_t, float max_t, RayHit* hit) const;
+
+  // Nearest hits of packet. Traversal is shared among rays
+  void Intersect(RayPacket* packet) const;
+
+  // Any hit in [min_t, max_t]. Traversal ends at the first hit found, which
+  // may not be the nearest. Cheaper than Intersect() for visibility
+  bool Occluded(const Eigen::Vector3f& org, const Eigen::Vector3f& dir,
+                float min_t, float max_t) const;
+
+  // prim_id of each ray is set to any hit or -1. Traversal ends when all rays
+  // hit
+  void Occluded(RayPacket* packet) const;
+
+  // # of faces given to Build() or stored in loaded file
+  int num_prims() const;
+  const BvhStats& stats() const;
+  const Eigen::Vector3f& bb_min() const;
+  const Eigen::Vector3f& bb_max() const;
+};
+
+// Bottom-level BVH placed in world by affine transform
+struct BvhInstance {
+  const Bvh* bvh{nullptr};
+  Eigen::Matrix3f linear{Eigen::Matrix3f::Identity()};  // object to world
+  Eigen::Vector3f translation{Eigen::Vector3f::Zero()};
+};
+
+// Top-level BVH over instances of bottom-level BVHs with the same 4-wide
+// nodes. A leaf is an instance and rays are transformed into its object
+// coordinate. Building it is cheap since bottom-level BVHs are kept when
+// instances move, and shared by instances of the same mesh
+class TopLevelBvh {
+  std::vector<BvhNode> nodes_;
+  std::vector<const Bvh*> bvhs_;
+  std::vector<Eigen::Matrix3f> w2o_linear_;  // world to object
+  std::vector<Eigen::Vector3f> translation_;
+  BvhStats stats_;
+
+  void Traverse(RayPacket* packet, bool any_hit) const;
+
+ public:
+  TopLevelBvh();
+  ~TopLevelBvh();
+
+  // Instance id is index of instances. Bottom-level BVHs must outlive this
+  bool Build(const std::vector<BvhInstance>& instances);
+  void Clear();
+  bool empty() const;
+
+  // Nearest hits of packet. t is the same as in world coordinate
+  // instance_id of packet is set
+  void Intersect(RayPacket* packet) const;
+
+  // Any hits of packet like Bvh::Occluded()
+  void Occluded(RayPacket* packet) const;
+
+  const BvhStats& stats() const;
+};
+
+// Builds BVH over faces of mesh, shared by renderers using BVH
+// If use_cache is true and RendererOption::bvh_cache_dir is not empty, BVH is
+// memory-mapped from cache of the same mesh and options, or saved there after
+// build
+bool PrepareMeshBvh(const Mesh& mesh, const RendererOption& option,
+                    const BvhBuildOption& build_option, bool use_cache,
+                    Bvh* bvh);
+
+}  // namespace currender
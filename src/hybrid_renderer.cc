@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "currender/hybrid_renderer.h"
+
+#include <algorithm>
+
+#include "src/bvh.h"
+#include "src/ray_table.h"
+#include "src/util_private.h"
+
+#include "ugu/timer.h"
+
+namespace {
+
+// Shadow rays of a square block of pixels are traced together as a packet.
+// Rays to a directional light are parallel and visit mostly the same nodes
+const int kPacketWidth = 4;
+const int kPacketSize = kPacketWidth * kPacketWidth;
+static_assert(kPacketSize == currender::kRayPacketSize,
+              "packet size must match BVH");
+
+// Square tiles of pixels are scheduled to threads
+const int kTileSize = 16;
+
+const float kFar = 1.0e+30f;
+
+}  // namespace
+
+namespace currender {
+
+// HybridRenderer::Impl implementation
+class HybridRenderer::Impl {
+  bool mesh_initialized_{false};
+  std::shared_ptr<const Camera> camera_{nullptr};
+  std::shared_ptr<const Mesh> mesh_{nullptr};
+  RendererOption option_;
+  ShadowOption shadow_option_;
+
+  // primary visibility
+  Rasterizer rasterizer_;
+
+  // secondary rays
+  Bvh bvh_;
+  BvhBuildOption bvh_build_option_;
+
+  // used if face id or depth is not requested
+  mutable Image1i face_id_buffer_;
+  mutable Image1f depth_w_;
+
+  // primary rays to reconstruct surface positions
+  mutable RayTable ray_table_;
+
+  void ApplyShadow(const Image1i& face_id, const Image1f* weight,
+                   Image3b* color) const;
+
+ public:
+  Impl();
+  ~Impl();
+
+  explicit Impl(const RendererOption& option);
+  void set_option(const RendererOption& option);
+
+  void set_mesh(std::shared_ptr<const Mesh> mesh);
+
+  bool PrepareMesh();
+
+  void set_bvh_build_option(const BvhBuildOption& option);
+  void set_shadow_option(const ShadowOption& option);
+
+  void set_camera(std::shared_ptr<const Camera> camera);
+
+  bool Render(Image3b* color, Image1f* depth, Image3f* normal, Image1b* mask,
+              Image1i* face_id) const;
+
+  bool RenderColor(Image3b* color) const;
+  bool RenderDepth(Image1f* depth) const;
+  bool RenderNormal(Image3f* normal) const;
+  bool RenderMask(Image1b* mask) const;
+  bool RenderFaceId(Image1i* face_id) const;
+
+  bool RenderW(Image3b* color, Image1w* depth, Image3f* normal, Image1b* mask,
+               Image1i* face_id) const;
+  bool RenderDepthW(Image1w* depth) const;
+
+  const RasterizerStats& stats() const;
+  const BvhStats& bvh_stats() const;
+};
+
+HybridRenderer::Impl::Impl() {}
+HybridRenderer::Impl::~Impl() {}
+
+HybridRenderer::Impl::Impl(const RendererOption& option) {
+  set_option(option);
+}
+
+void HybridRenderer::Impl::set_option(const RendererOption& option) {
+  option.CopyTo(&option_);
+  rasterizer_.set_option(option_);
+}
+
+void HybridRenderer::Impl::set_mesh(std::shared_ptr<const Mesh> mesh) {
+  mesh_initialized_ = false;
+  mesh_ = mesh;
+  rasterizer_.set_mesh(mesh);
+  bvh_.Clear();
+}
+
+bool HybridRenderer::Impl::PrepareMesh() {
+  if (mesh_ == nullptr) {
+    LOGE("mesh has not been set\n");
+    return false;
+  }
+
+  if (mesh_->vertices().empty() || mesh_->vertex_indices().empty()) {
+    LOGE("mesh is empty\n");
+    return false;
+  }
+
+  if (!rasterizer_.PrepareMesh()) {
+    return false;
+  }
+
+  if (!PrepareMeshBvh(*mesh_, option_, bvh_build_option_, true, &bvh_)) {
+    return false;
+  }
+
+  mesh_initialized_ = true;
+
+  return true;
+}
+
+void HybridRenderer::Impl::set_bvh_build_option(const BvhBuildOption& option) {
+  bvh_build_option_ = option;
+}
+
+void HybridRenderer::Impl::set_shadow_option(const ShadowOption& option) {
+  shadow_option_ = option;
+}
+
+void HybridRenderer::Impl::set_camera(std::shared_ptr<const Camera> camera) {
+  camera_ = camera;
+  rasterizer_.set_camera(camera);
+}
+
+// Darkens color of pixels whose surface is occluded from light
+// Surface position is interpolated by barycentric weights of the rasterized
+// face, so no primary ray is traced
+void HybridRenderer::Impl::ApplyShadow(const Image1i& face_id,
+                                       const Image1f* weight,
+                                       Image3b* color) const {
+  const auto& vertices = mesh_->vertices();
+  const auto& faces = mesh_->vertex_indices();
+  const Eigen::Vector3f light_w = -shadow_option_.light_dir.normalized();
+  const float bias =
+      shadow_option_.bias * (bvh_.bb_max() - bvh_.bb_min()).norm();
+  const float attenuation = std::max(shadow_option_.attenuation, 0.0f);
+  ray_table_.Update(*camera_);
+
+  const int width = camera_->width();
+  const int height = camera_->height();
+  const int tile_cols = (width + kTileSize - 1) / kTileSize;
+  const int tile_rows = (height + kTileSize - 1) / kTileSize;
+
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (int tile = 0; tile < tile_cols * tile_rows; tile++) {
+    const int tile_x = (tile % tile_cols) * kTileSize;
+    const int tile_y = (tile / tile_cols) * kTileSize;
+    const int tile_x_end = std::min(tile_x + kTileSize, width);
+    const int tile_y_end = std::min(tile_y + kTileSize, height);
+    for (int py = tile_y; py < tile_y_end; py += kPacketWidth) {
+      for (int px = tile_x; px < tile_x_end; px += kPacketWidth) {
+        RayPacket packet;
+        bool shadowed[kPacketSize];
+        bool any_active = false;
+        for (int j = 0; j < kPacketSize; j++) {
+          const int x = px + j % kPacketWidth;
+          const int y = py + j / kPacketWidth;
+          // inactive rays have empty range
+          for (int k = 0; k < 3; k++) {
+            packet.org[k][j] = 0.0f;
+            packet.dir[k][j] = light_w[k];
+          }
+          packet.min_t[j] = 1.0f;
+          packet.max_t[j] = 0.0f;
+          shadowed[j] = false;
+          const int fid =
+              x < width && y < height ? face_id.at<int>(y, x) : -1;
+          if (fid < 0) {
+            continue;
+          }
+
+          const Eigen::Vector3i& face = faces[fid];
+          const Eigen::Vector3f& v0 = vertices[face[0]];
+          const Eigen::Vector3f& v1 = vertices[face[1]];
+          const Eigen::Vector3f& v2 = vertices[face[2]];
+          const Eigen::Vector3f hit_pos_w = weight[0].at<float>(y, x) * v0 +
+                                            weight[1].at<float>(y, x) * v1 +
+                                            weight[2].at<float>(y, x) * v2;
+
+          // normal facing the viewer. surface facing away from light is
+          // always in shadow
+          Eigen::Vector3f n = (v1 - v0).cross(v2 - v0);
+          Eigen::Vector3f ray_w;
+          ray_table_.ray_w(x, y, &ray_w);
+          n = n.dot(ray_w) > 0.0f ? -n.normalized() : n.normalized();
+          if (n.dot(light_w) <= 0.0f) {
+            shadowed[j] = true;
+            continue;
+          }
+
+          const Eigen::Vector3f org = hit_pos_w + n * bias;
+          for (int k = 0; k < 3; k++) {
+            packet.org[k][j] = org[k];
+          }
+          packet.min_t[j] = 0.0f;
+          packet.max_t[j] = kFar;
+          any_active = true;
+        }
+
+        // any hit is enough to decide shadow
+        if (any_active) {
+          bvh_.Occluded(&packet);
+        }
+
+        for (int j = 0; j < kPacketSize; j++) {
+          const int x = px + j % kPacketWidth;
+          const int y = py + j / kPacketWidth;
+          if (!shadowed[j] && (!any_active || packet.prim_id[j] < 0)) {
+            continue;
+          }
+          Vec3b& c = color->at<Vec3b>(y, x);
+          for (int k = 0; k < 3; k++) {
+            c[k] = static_cast<unsigned char>(
+                std::min(c[k] * attenuation, 255.0f));
+          }
+        }
+      }
+    }
+  }
+}
+
+bool HybridRenderer::Impl::Render(Image3b* color, Image1f* depth,
+                                  Image3f* normal, Image1b* mask,
+                                  Image1i* face_id) const {
+  if (!mesh_initialized_) {
+    LOGE("mesh has not been initialized\n");
+    return false;
+  }
+
+  // shadow needs face id of pixels
+  const bool shadow = color != nullptr && shadow_option_.enabled;
+  Image1i* face_id_{face_id};
+  if (shadow && face_id_ == nullptr) {
+    face_id_ = &face_id_buffer_;
+  }
+
+  if (!rasterizer_.Render(color, depth, normal, mask, face_id_)) {
+    return false;
+  }
+
+  if (shadow) {
+    Timer<> timer;
+    timer.Start();
+    ApplyShadow(*face_id_, rasterizer_.barycentric(), color);
+    timer.End();
+    LOGI("  Shadow ray time: %.1f msecs\n", timer.elapsed_msec());
+  }
+
+  return true;
+}
+
+bool HybridRenderer::Impl::RenderColor(Image3b* color) const {
+  return Render(color, nullptr, nullptr, nullptr, nullptr);
+}
+
+bool HybridRenderer::Impl::RenderDepth(Image1f* depth) const {
+  return Render(nullptr, depth, nullptr, nullptr, nullptr);
+}
+
+bool HybridRenderer::Impl::RenderNormal(Image3f* normal) const {
+  return Render(nullptr, nullptr, normal, nullptr, nullptr);
+}
+
+bool HybridRenderer::Impl::RenderMask(Image1b* mask) const {
+  return Render(nullptr, nullptr, nullptr, mask, nullptr);
+}
+
+bool HybridRenderer::Impl::RenderFaceId(Image1i* face_id) const {
+  return Render(nullptr, nullptr, nullptr, nullptr, face_id);
+}
+
+bool HybridRenderer::Impl::RenderW(Image3b* color, Image1w* depth,
+                                   Image3f* normal, Image1b* mask,
+                                   Image1i* face_id) const {
+  if (depth == nullptr) {
+    LOGE("depth is nullptr");
+    return false;
+  }
+
+  bool org_ret = Render(color, &depth_w_, normal, mask, face_id);
+
+  if (org_ret) {
+    ConvertTo(depth_w_, depth);
+  }
+
+  return org_ret;
+}
+
+bool HybridRenderer::Impl::RenderDepthW(Image1w* depth) const {
+  return RenderW(nullptr, depth, nullptr, nullptr, nullptr);
+}
+
+const RasterizerStats& HybridRenderer::Impl::stats() const {
+  return rasterizer_.stats();
+}
+
+const BvhStats& HybridRenderer::Impl::bvh_stats() const {
+  return bvh_.stats();
+}
+
+// Renderer implementation
+HybridRenderer::HybridRenderer() : pimpl_(std::unique_ptr<Impl>(new Impl)) {}
+
+HybridRenderer::~HybridRenderer() {}
+
+HybridRenderer::HybridRenderer(const RendererOption& option)
+    : pimpl_(std::unique_ptr<Impl>(new Impl(option))) {}
+
+void HybridRenderer::set_option(const RendererOption& option) {
+  pimpl_->set_option(option);
+}
+
+void HybridRenderer::set_mesh(std::shared_ptr<const Mesh> mesh) {
+  pimpl_->set_mesh(mesh);
+}
+
+bool HybridRenderer::PrepareMesh() { return pimpl_->PrepareMesh(); }
+
+void HybridRenderer::set_bvh_build_option(const BvhBuildOption& option) {
+  pimpl_->set_bvh_build_option(option);
+}
+
+void HybridRenderer::set_shadow_option(const ShadowOption& option) {
+  pimpl_->set_shadow_option(option);
+}
+
+void HybridRenderer::set_camera(std::shared_ptr<const Camera> camera) {
+  pimpl_->set_camera(camera);
+}
+
+bool HybridRenderer::Render(Image3b* color, Image1f* depth, Image3f* normal,
+                            Image1b* mask, Image1i* face_id) const {
+  return pimpl_->Render(color, depth, normal, mask, face_id);
+}
+
+bool HybridRenderer::RenderColor(Image3b* color) const {
+  return pimpl_->RenderColor(color);
+}
+
+bool HybridRenderer::RenderDepth(Image1f* depth) const {
+  return pimpl_->RenderDepth(depth);
+}
+
+bool HybridRenderer::RenderNormal(Image3f* normal) const {
+  return pimpl_->RenderNormal(normal);
+}
+
+bool HybridRenderer::RenderMask(Image1b* mask) const {
+  return pimpl_->RenderMask(mask);
+}
+
+bool HybridRenderer::RenderFaceId(Image1i* face_id) const {
+  return pimpl_->RenderFaceId(face_id);
+}
+
+bool HybridRenderer::RenderW(Image3b* color, Image1w* depth, Image3f* normal,
+                             Image1b* mask, Image1i* face_id) const {
+  return pimpl_->RenderW(color, depth, normal, mask, face_id);
+}
+
+bool HybridRenderer::RenderDepthW(Image1w* depth) const {
+  return pimpl_->RenderDepthW(depth);
+}
+
+const RasterizerStats& HybridRenderer::stats() const {
+  return pimpl_->stats();
+}
+
+const BvhStats& HybridRenderer::bvh_stats() const {
+  return pimpl_->bvh_stats();
+}
+
+}  // namespace currender
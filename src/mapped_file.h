@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace currender {
+
+// Read-only memory-mapped file
+// Pages are shared with other processes mapping the same file through OS
+// page cache
+class MappedFile {
+  const uint8_t* data_{nullptr};
+  size_t size_{0};
+#ifdef _WIN32
+  void* file_{nullptr};
+  void* mapping_{nullptr};
+#else
+  int fd_{-1};
+#endif
+
+ public:
+  MappedFile();
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Returns false if file does not exist or can not be mapped
+  bool Open(const std::string& path);
+  void Close();
+
+  const uint8_t* data() const;
+  size_t size() const;
+};
+
+}  // namespace currender
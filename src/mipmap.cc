@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "src/mipmap.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "src/util_private.h"
+
+#include "ugu/timer.h"
+
+namespace {
+
+bool NeedPyramid(const currender::RendererOption& option) {
+  return option.diffuse_color == currender::DiffuseColor::kTexture &&
+         option.interp == currender::ColorInterpolation::kTrilinear;
+}
+
+// Half size by averaging 2x2 texels. Last row or column of odd size is
+// averaged with itself
+void Downsample(const currender::TiledTexture& src,
+                currender::TiledTexture* dst) {
+  const int cols = std::max(src.cols() / 2, 1);
+  const int rows = std::max(src.rows() / 2, 1);
+  dst->Init(cols, rows);
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(static)
+#endif
+  for (int y = 0; y < rows; y++) {
+    const int y0 = std::min(2 * y, src.rows() - 1);
+    const int y1 = std::min(2 * y + 1, src.rows() - 1);
+    for (int x = 0; x < cols; x++) {
+      const int x0 = std::min(2 * x, src.cols() - 1);
+      const int x1 = std::min(2 * x + 1, src.cols() - 1);
+      const uint8_t* c00 = src.at(y0, x0);
+      const uint8_t* c01 = src.at(y0, x1);
+      const uint8_t* c10 = src.at(y1, x0);
+      const uint8_t* c11 = src.at(y1, x1);
+      uint8_t* c = dst->at(y, x);
+      for (int k = 0; k < 3; k++) {
+        const int sum = c00[k] + c01[k] + c10[k] + c11[k];
+        c[k] = static_cast<uint8_t>((sum + 2) / 4);
+      }
+    }
+  }
+}
+
+// Hash of texels row by row not to depend on padding of rows
+uint64_t TextureHash(const currender::Image3b& texture) {
+  uint64_t hash = 0;
+  for (int y = 0; y < texture.rows; y++) {
+    hash = currender::HashBytes(&texture.at<currender::Vec3b>(y, 0),
+                                sizeof(currender::Vec3b) * texture.cols, hash);
+  }
+  return hash;
+}
+
+}  // namespace
+
+namespace currender {
+
+Mipmap::Mipmap() {}
+Mipmap::~Mipmap() {}
+
+void Mipmap::Build(const Image3b& texture, bool pyramid) {
+  const uint64_t texture_hash = TextureHash(texture);
+  if (!IsBuiltFrom(texture) || texture_hash_ != texture_hash) {
+    texture_data_ = texture.data;
+    texture_cols_ = texture.cols;
+    texture_rows_ = texture.rows;
+    texture_hash_ = texture_hash;
+    levels_.clear();
+    levels_.emplace_back();
+    levels_.back().Build(texture);
+  }
+
+  pyramid_ = pyramid;
+  if (!pyramid_) {
+    levels_.resize(1);
+    return;
+  }
+  for (;;) {
+    const TiledTexture& prev = levels_.back();
+    if (prev.cols() <= 1 && prev.rows() <= 1) {
+      break;
+    }
+    TiledTexture next;
+    Downsample(prev, &next);
+    levels_.push_back(std::move(next));
+  }
+}
+
+void Mipmap::Clear() {
+  texture_data_ = nullptr;
+  texture_cols_ = 0;
+  texture_rows_ = 0;
+  texture_hash_ = 0;
+  pyramid_ = false;
+  levels_.clear();
+}
+
+bool Mipmap::IsBuiltFrom(const Image3b& texture) const {
+  return !levels_.empty() && texture_data_ == texture.data &&
+         texture_cols_ == texture.cols && texture_rows_ == texture.rows;
+}
+
+bool Mipmap::pyramid() const { return pyramid_; }
+
+int Mipmap::num_levels() const { return static_cast<int>(levels_.size()); }
+
+const TiledTexture& Mipmap::level(int i) const { return levels_[i]; }
+
+void PrepareMipmaps(const Mesh& mesh, const RendererOption& option,
+                    std::vector<Mipmap>* mipmaps) {
+  if (option.diffuse_color != DiffuseColor::kTexture) {
+    mipmaps->clear();
+    return;
+  }
+
+  Timer<> timer;
+  timer.Start();
+  const auto& materials = mesh.materials();
+  mipmaps->resize(materials.size());
+  for (size_t i = 0; i < materials.size(); i++) {
+    (*mipmaps)[i].Build(materials[i].diffuse_tex, NeedPyramid(option));
+  }
+  timer.End();
+  LOGI("  Mipmap building time: %.1f msecs\n", timer.elapsed_msec());
+}
+
+bool MipmapsBuiltFrom(const Mesh& mesh, const std::vector<Mipmap>& mipmaps) {
+  const auto& materials = mesh.materials();
+  if (mipmaps.size() != materials.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < materials.size(); i++) {
+    if (!mipmaps[i].IsBuiltFrom(materials[i].diffuse_tex)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ValidateMipmaps(const Mesh& mesh, const RendererOption& option,
+                     const std::vector<Mipmap>& mipmaps) {
+  if (!NeedPyramid(option)) {
+    return true;
+  }
+  const auto& materials = mesh.materials();
+  bool valid = mipmaps.size() == materials.size();
+  for (size_t i = 0; valid && i < materials.size(); i++) {
+    valid = mipmaps[i].IsBuiltFrom(materials[i].diffuse_tex) &&
+            mipmaps[i].pyramid();
+  }
+  if (!valid) {
+    LOGE(
+        "mipmaps for trilinear interpolation are not prepared. call "
+        "PrepareMesh() after set_option()\n");
+  }
+  return valid;
+}
+
+}  // namespace currender
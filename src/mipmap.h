@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "currender/renderer.h"
+#include "src/tiled_texture.h"
+
+namespace currender {
+
+// Tiled copies of texture for sampling. Level 0 is the original texture and
+// each next level is half size by 2x2 box filter down to 1x1 for trilinear
+// sampling. Texture of mesh stays the source and is not referred after Build()
+class Mipmap {
+  const unsigned char* texture_data_{nullptr};
+  int texture_cols_{0};
+  int texture_rows_{0};
+  uint64_t texture_hash_{0};
+  bool pyramid_{false};
+  std::vector<TiledTexture> levels_;
+
+ public:
+  Mipmap();
+  ~Mipmap();
+  Mipmap(const Mipmap&) = delete;
+  Mipmap& operator=(const Mipmap&) = delete;
+  Mipmap(Mipmap&&) = default;
+  Mipmap& operator=(Mipmap&&) = default;
+
+  // Only level 0 is built if pyramid is false. Levels are kept if texture has
+  // the same buffer, size and hash of texels as the last Build(), so texture
+  // edited in place is copied again
+  void Build(const Image3b& texture, bool pyramid);
+  void Clear();
+  // Cheap check at rendering that the last Build() was from buffer of
+  // texture. Texels are not compared
+  bool IsBuiltFrom(const Image3b& texture) const;
+  bool pyramid() const;
+
+  int num_levels() const;
+  const TiledTexture& level(int i) const;
+};
+
+// Tiled diffuse textures of materials, built if option uses texture and
+// cleared otherwise. Coarser levels are built only for
+// ColorInterpolation::kTrilinear
+void PrepareMipmaps(const Mesh& mesh, const RendererOption& option,
+                    std::vector<Mipmap>* mipmaps);
+
+// True if mipmaps were built from buffers of all textures of mesh. Texels are
+// not compared so that this is cheap enough to call every frame
+bool MipmapsBuiltFrom(const Mesh& mesh, const std::vector<Mipmap>& mipmaps);
+
+// Checks mipmaps are prepared for mesh and option. Only kTrilinear needs
+// them since other interpolations fall back to texture of mesh
+bool ValidateMipmaps(const Mesh& mesh, const RendererOption& option,
+                     const std::vector<Mipmap>& mipmaps);
+
+}  // namespace currender
@@ -6,10 +6,16 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include "currender/renderer.h"
+#include "src/mipmap.h"
+#include "src/ray_table.h"
+#include "src/shade_kernel.h"
 
 #include "ugu/common.h"
 #include "ugu/image.h"
@@ -27,112 +33,161 @@ struct OrenNayarParam {
   ~OrenNayarParam();
 };
 
-struct PixelShaderInput {
+// Raw read-only views of mesh attributes and parameters for shading,
+// resolved once per render so that pixels are shaded without touching
+// reference count of mesh. Mesh must outlive this
+struct ShadingContext {
  public:
-  PixelShaderInput() = delete;
-  Image3b* color{nullptr};
-  int x;
-  int y;
-  float u;
-  float v;
-  uint32_t face_index;
-  const Eigen::Vector3f* ray_w{nullptr};
-  const Eigen::Vector3f* light_dir{nullptr};
-  const Eigen::Vector3f* shading_normal{nullptr};
-  const OrenNayarParam* oren_nayar_param{nullptr};
-  std::shared_ptr<const Mesh> mesh{nullptr};
-
-  PixelShaderInput(Image3b* color, int x, int y, float u, float v,
-                   uint32_t face_index, const Eigen::Vector3f* ray_w,
-                   const Eigen::Vector3f* light_dir,
-                   const Eigen::Vector3f* shading_normal,
-                   const OrenNayarParam* oren_nayar_param,
-                   std::shared_ptr<const Mesh> mesh);
-  ~PixelShaderInput();
+  const Eigen::Vector3f* vertices{nullptr};
+  const Eigen::Vector3i* faces{nullptr};
+  const Eigen::Vector3f* vertex_colors{nullptr};
+  const Eigen::Vector2f* uv{nullptr};
+  const Eigen::Vector3i* uv_indices{nullptr};
+  const Eigen::Vector3f* normals{nullptr};
+  const Eigen::Vector3i* normal_indices{nullptr};
+  const Eigen::Vector3f* face_normals{nullptr};
+  const int* material_ids{nullptr};
+  std::vector<const Image3b*> diffuse_textures;  // of each material
+  // tiled copies of diffuse_textures. empty if not prepared for the mesh
+  std::vector<const Mipmap*> mipmaps;
+  OrenNayarParam oren_nayar_param;
+
+  ShadingContext();
+  ShadingContext(const Mesh& mesh, const RendererOption& option,
+                 const std::vector<Mipmap>* mipmaps = nullptr);
+  ~ShadingContext();
+
+  // Resolves views again. Capacity of per-material vectors is kept so that
+  // a context reused over rendering does no heap allocation
+  void Reset(const Mesh& mesh, const RendererOption& option,
+             const std::vector<Mipmap>* mipmaps = nullptr);
 };
 
-class DiffuseColorizer {
+// # of pixels shaded together by PixelShader
+const int kShadingBatchSize = 16;
+static_assert(kShadingBatchSize == kShadeKernelWidth,
+              "batch size must match lighting kernel");
+
+// Hits of pixels to be shaded together in structure of arrays so that
+// interpolation and lighting run over all of them in a loop. Hits are
+// collected after traversal or rasterization of a tile and then shaded
+// Light comes from the camera (same direction as ray)
+struct ShadingBatch {
  public:
-  virtual ~DiffuseColorizer() {}
-  virtual void Process(const PixelShaderInput& input) const = 0;
+  const ShadingContext* context{nullptr};
+  int size{0};
+  int x[kShadingBatchSize];
+  int y[kShadingBatchSize];
+  uint32_t face_index[kShadingBatchSize];
+  float u[kShadingBatchSize];  // barycentric of 2nd vertex
+  float v[kShadingBatchSize];  // barycentric of 3rd vertex
+  float ray_w[3][kShadingBatchSize];
+  float shading_normal[3][kShadingBatchSize];
+  // derivatives of (u, v) with respect to image x and y for texture LOD
+  float uv_dx[2][kShadingBatchSize];
+  float uv_dy[2][kShadingBatchSize];
 };
 
-class DiffuseDefaultColorizer : public DiffuseColorizer {
- public:
-  DiffuseDefaultColorizer();
-  ~DiffuseDefaultColorizer();
-  void Process(const PixelShaderInput& input) const override;
+// Derivatives of barycentric (u, v) on triangle (v0, v1, v2) in world
+// coordinate with respect to image x and y at pixel (x, y) as
+// {du/dx, dv/dx, du/dy, dv/dy}. Rays through neighboring pixels are
+// intersected with plane of the triangle, so neighbors need not hit it
+void BarycentricDerivatives(const RayTable& rays, int x, int y,
+                            const Eigen::Vector3f& v0,
+                            const Eigen::Vector3f& v1,
+                            const Eigen::Vector3f& v2, float derivatives[4]);
+
+// Colors of a batch in structure of arrays
+typedef uint8_t BatchColor[3][kShadingBatchSize];
+
+// Colorizer writes diffuse color of pixels in batch and shader modulates it.
+// They have no state and are combined at compile time into a PixelShader
+// kernel, so color stays in local arrays until written to image once
+struct DiffuseDefaultColorizer {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseVertexColorColorizer : public DiffuseColorizer {
- public:
-  DiffuseVertexColorColorizer();
-  ~DiffuseVertexColorColorizer();
-  void Process(const PixelShaderInput& input) const override;
+struct DiffuseVertexColorColorizer {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseTextureNnColorizer : public DiffuseColorizer {
- public:
-  DiffuseTextureNnColorizer();
-  ~DiffuseTextureNnColorizer();
-  void Process(const PixelShaderInput& input) const override;
+struct DiffuseTextureNnColorizer {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseTextureBilinearColorizer : public DiffuseColorizer {
- public:
-  DiffuseTextureBilinearColorizer();
-  ~DiffuseTextureBilinearColorizer();
-  void Process(const PixelShaderInput& input) const override;
+struct DiffuseTextureBilinearColorizer {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseShader {
- public:
-  virtual ~DiffuseShader() {}
-  virtual void Process(const PixelShaderInput& input) const = 0;
+struct DiffuseTextureTrilinearColorizer {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseDefaultShader : public DiffuseShader {
- public:
-  DiffuseDefaultShader();
-  ~DiffuseDefaultShader();
-  void Process(const PixelShaderInput& input) const override;
+struct DiffuseDefaultShader {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseLambertianShader : public DiffuseShader {
- public:
-  DiffuseLambertianShader();
-  ~DiffuseLambertianShader();
-  void Process(const PixelShaderInput& input) const override;
+struct DiffuseLambertianShader {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
-class DiffuseOrenNayarShader : public DiffuseShader {
- public:
-  DiffuseOrenNayarShader();
-  ~DiffuseOrenNayarShader();
-  void Process(const PixelShaderInput& input) const override;
+struct DiffuseOrenNayarShader {
+  static void Process(const ShadingBatch& batch, BatchColor c);
 };
 
+// Shades pixels in batches. A kernel is specialized for each combination of
+// DiffuseColor, ColorInterpolation and DiffuseShading, and selected once by
+// PixelShaderFactory
 class PixelShader {
-  std::unique_ptr<DiffuseColorizer> diffuse_colorizer_{nullptr};
-  std::unique_ptr<DiffuseShader> diffuse_shader_{nullptr};
-  PixelShader(std::unique_ptr<DiffuseColorizer>&& diffuse_colorizer,
-              std::unique_ptr<DiffuseShader>&& diffuse_shader);
-
  public:
   PixelShader(const PixelShader&) = delete;
   PixelShader& operator=(const PixelShader&) = delete;
   PixelShader(PixelShader&&) = delete;
   PixelShader& operator=(PixelShader&&) = delete;
-  friend class PixelShaderFactory;
   PixelShader();
-  ~PixelShader();
-  void Process(const PixelShaderInput& input) const;
+  virtual ~PixelShader();
+
+  // Shades all pixels of batch into color
+  virtual void Process(const ShadingBatch& batch, Image3b* color) const = 0;
+
+  // Adds a hit to batch. Batch is shaded and emptied in advance if it is
+  // full or its context is different
+  // uv_derivatives is from BarycentricDerivatives() and needed only for
+  // ColorInterpolation::kTrilinear. Zero if nullptr
+  void Push(const ShadingContext* context, int x, int y, float u, float v,
+            uint32_t face_index, const Eigen::Vector3f& ray_w,
+            const Eigen::Vector3f& shading_normal, ShadingBatch* batch,
+            Image3b* color, const float* uv_derivatives = nullptr) const;
+
+  // Shades and empties remaining hits of batch
+  void Flush(ShadingBatch* batch, Image3b* color) const;
+};
+
+template <typename Colorizer, typename Shader>
+class PixelShaderKernel : public PixelShader {
+ public:
+  PixelShaderKernel() {}
+  ~PixelShaderKernel() override {}
+  void Process(const ShadingBatch& batch, Image3b* color) const override {
+    BatchColor c;
+    Colorizer::Process(batch, c);
+    Shader::Process(batch, c);
+    for (int j = 0; j < batch.size; j++) {
+      Vec3b& dst = color->at<Vec3b>(batch.y[j], batch.x[j]);
+      for (int k = 0; k < 3; k++) {
+        dst[k] = c[k][j];
+      }
+    }
+  }
 };
 
 class PixelShaderFactory {
   PixelShaderFactory();
   ~PixelShaderFactory();
 
+  template <typename Colorizer>
+  static std::unique_ptr<PixelShader> Create(DiffuseShading diffuse_shading);
+
  public:
   static std::unique_ptr<PixelShader> Create(DiffuseColor diffuse_color,
                                              ColorInterpolation interp,
@@ -148,277 +203,424 @@ inline OrenNayarParam::OrenNayarParam(float sigma) : sigma(sigma) {
 }
 inline OrenNayarParam::~OrenNayarParam() {}
 
-inline PixelShaderInput::~PixelShaderInput() {}
-inline PixelShaderInput::PixelShaderInput(
-    Image3b* color, int x, int y, float u, float v, uint32_t face_index,
-    const Eigen::Vector3f* ray_w, const Eigen::Vector3f* light_dir,
-    const Eigen::Vector3f* shading_normal,
-    const OrenNayarParam* oren_nayar_param, std::shared_ptr<const Mesh> mesh)
-    : color(color),
-      x(x),
-      y(y),
-      u(u),
-      v(v),
-      face_index(face_index),
-      ray_w(ray_w),
-      light_dir(light_dir),
-      shading_normal(shading_normal),
-      oren_nayar_param(oren_nayar_param),
-      mesh(mesh) {}
+inline ShadingContext::ShadingContext() {}
+inline ShadingContext::ShadingContext(const Mesh& mesh,
+                                      const RendererOption& option,
+                                      const std::vector<Mipmap>* mipmaps) {
+  Reset(mesh, option, mipmaps);
+}
+inline ShadingContext::~ShadingContext() {}
+inline void ShadingContext::Reset(const Mesh& mesh,
+                                  const RendererOption& option,
+                                  const std::vector<Mipmap>* mipmaps) {
+  vertices = mesh.vertices().data();
+  faces = mesh.vertex_indices().data();
+  vertex_colors = mesh.vertex_colors().data();
+  uv = mesh.uv().data();
+  uv_indices = mesh.uv_indices().data();
+  normals = mesh.normals().data();
+  normal_indices = mesh.normal_indices().data();
+  face_normals = mesh.face_normals().data();
+  material_ids = mesh.material_ids().data();
+  oren_nayar_param = OrenNayarParam(option.oren_nayar_sigma);
+  diffuse_textures.clear();
+  this->mipmaps.clear();
+  for (const auto& material : mesh.materials()) {
+    diffuse_textures.push_back(&material.diffuse_tex);
+  }
+  if (mipmaps != nullptr && mipmaps->size() == diffuse_textures.size()) {
+    for (size_t i = 0; i < mipmaps->size(); i++) {
+      if (!(*mipmaps)[i].IsBuiltFrom(*diffuse_textures[i])) {
+        this->mipmaps.clear();
+        break;
+      }
+      this->mipmaps.push_back(&(*mipmaps)[i]);
+    }
+  }
+}
 
 inline PixelShaderFactory::PixelShaderFactory() {}
 
 inline PixelShaderFactory::~PixelShaderFactory() {}
 
+template <typename Colorizer>
+inline std::unique_ptr<PixelShader> PixelShaderFactory::Create(
+    DiffuseShading diffuse_shading) {
+  std::unique_ptr<PixelShader> shader;
+  if (diffuse_shading == DiffuseShading::kNone) {
+    shader.reset(new PixelShaderKernel<Colorizer, DiffuseDefaultShader>);
+  } else if (diffuse_shading == DiffuseShading::kLambertian) {
+    shader.reset(new PixelShaderKernel<Colorizer, DiffuseLambertianShader>);
+  } else if (diffuse_shading == DiffuseShading::kOrenNayar) {
+    shader.reset(new PixelShaderKernel<Colorizer, DiffuseOrenNayarShader>);
+  }
+  return shader;
+}
+
 inline std::unique_ptr<PixelShader> PixelShaderFactory::Create(
     DiffuseColor diffuse_color, ColorInterpolation interp,
     DiffuseShading diffuse_shading) {
-  std::unique_ptr<DiffuseColorizer> colorizer;
-  std::unique_ptr<DiffuseShader> shader;
+  std::unique_ptr<PixelShader> shader;
 
   if (diffuse_color == DiffuseColor::kVertex) {
-    colorizer.reset(new DiffuseVertexColorColorizer);
+    shader = Create<DiffuseVertexColorColorizer>(diffuse_shading);
   } else if (diffuse_color == DiffuseColor::kTexture) {
     if (interp == ColorInterpolation::kNn) {
-      colorizer.reset(new DiffuseTextureNnColorizer);
+      shader = Create<DiffuseTextureNnColorizer>(diffuse_shading);
     } else if (interp == ColorInterpolation::kBilinear) {
-      colorizer.reset(new DiffuseTextureBilinearColorizer);
+      shader = Create<DiffuseTextureBilinearColorizer>(diffuse_shading);
+    } else if (interp == ColorInterpolation::kTrilinear) {
+      shader = Create<DiffuseTextureTrilinearColorizer>(diffuse_shading);
     }
   } else if (diffuse_color == DiffuseColor::kNone) {
-    colorizer.reset(new DiffuseDefaultColorizer);
-  }
-  assert(colorizer);
-
-  if (diffuse_shading == DiffuseShading::kNone) {
-    shader.reset(new DiffuseDefaultShader);
-  } else if (diffuse_shading == DiffuseShading::kLambertian) {
-    shader.reset(new DiffuseLambertianShader);
-  } else if (diffuse_shading == DiffuseShading::kOrenNayar) {
-    shader.reset(new DiffuseOrenNayarShader);
+    shader = Create<DiffuseDefaultColorizer>(diffuse_shading);
   }
   assert(shader);
 
-  return std::unique_ptr<PixelShader>(
-      new PixelShader(std::move(colorizer), std::move(shader)));
+  return shader;
 }
 
 inline PixelShader::PixelShader() {}
 inline PixelShader::~PixelShader() {}
 
-inline PixelShader::PixelShader(
-    std::unique_ptr<DiffuseColorizer>&& diffuse_colorizer,
-    std::unique_ptr<DiffuseShader>&& diffuse_shader) {
-  diffuse_colorizer_ = std::move(diffuse_colorizer);
-  diffuse_shader_ = std::move(diffuse_shader);
+inline void PixelShader::Push(const ShadingContext* context, int x, int y,
+                              float u, float v, uint32_t face_index,
+                              const Eigen::Vector3f& ray_w,
+                              const Eigen::Vector3f& shading_normal,
+                              ShadingBatch* batch, Image3b* color,
+                              const float* uv_derivatives) const {
+  if (batch->size == kShadingBatchSize ||
+      (batch->size > 0 && batch->context != context)) {
+    Flush(batch, color);
+  }
+  const int j = batch->size++;
+  batch->context = context;
+  batch->x[j] = x;
+  batch->y[j] = y;
+  batch->u[j] = u;
+  batch->v[j] = v;
+  batch->face_index[j] = face_index;
+  for (int k = 0; k < 3; k++) {
+    batch->ray_w[k][j] = ray_w[k];
+    batch->shading_normal[k][j] = shading_normal[k];
+  }
+  for (int k = 0; k < 2; k++) {
+    batch->uv_dx[k][j] = uv_derivatives != nullptr ? uv_derivatives[k] : 0.0f;
+    batch->uv_dy[k][j] =
+        uv_derivatives != nullptr ? uv_derivatives[2 + k] : 0.0f;
+  }
 }
 
-inline void PixelShader::Process(const PixelShaderInput& input) const {
-  diffuse_colorizer_->Process(input);
-  diffuse_shader_->Process(input);
+// (u, v) where ray crosses plane of triangle by Moller-Trumbore without
+// bounds test. Returns false if ray is parallel to the plane
+inline bool PlaneBarycentric(const Eigen::Vector3f& v0,
+                             const Eigen::Vector3f& e1,
+                             const Eigen::Vector3f& e2,
+                             const Eigen::Vector3f& org,
+                             const Eigen::Vector3f& dir, float* u, float* v) {
+  const Eigen::Vector3f p = dir.cross(e2);
+  const float det = e1.dot(p);
+  if (std::abs(det) < std::numeric_limits<float>::min()) {
+    return false;
+  }
+  const float inv_det = 1.0f / det;
+  const Eigen::Vector3f t = org - v0;
+  const Eigen::Vector3f q = t.cross(e1);
+  *u = t.dot(p) * inv_det;
+  *v = dir.dot(q) * inv_det;
+  return true;
 }
 
-inline DiffuseDefaultColorizer::DiffuseDefaultColorizer() {}
-inline DiffuseDefaultColorizer::~DiffuseDefaultColorizer() {}
-inline void DiffuseDefaultColorizer::Process(
-    const PixelShaderInput& input) const {
-  Image3b* color = input.color;
-  int x = input.x;
-  int y = input.y;
+inline void BarycentricDerivatives(const RayTable& rays, int x, int y,
+                                   const Eigen::Vector3f& v0,
+                                   const Eigen::Vector3f& v1,
+                                   const Eigen::Vector3f& v2,
+                                   float derivatives[4]) {
+  std::fill(derivatives, derivatives + 4, 0.0f);
+  const Eigen::Vector3f e1 = v1 - v0;
+  const Eigen::Vector3f e2 = v2 - v0;
+  Eigen::Vector3f org, dir;
+  rays.org_ray_w(x, y, &org);
+  rays.ray_w(x, y, &dir);
+  float u, v;
+  if (!PlaneBarycentric(v0, e1, e2, org, dir, &u, &v)) {
+    return;
+  }
 
-  std::memset(&color->data[color->cols * 3 * y + x * 3], 255,
-              sizeof(unsigned char) * 3);
+  // forward difference, or backward one at the last column or row
+  const int dx = x + 1 < rays.width() ? 1 : -1;
+  const int dy = y + 1 < rays.height() ? 1 : -1;
+  float u_n, v_n;
+  if (0 <= x + dx) {
+    rays.org_ray_w(x + dx, y, &org);
+    rays.ray_w(x + dx, y, &dir);
+    if (PlaneBarycentric(v0, e1, e2, org, dir, &u_n, &v_n)) {
+      derivatives[0] = (u_n - u) * dx;
+      derivatives[1] = (v_n - v) * dx;
+    }
+  }
+  if (0 <= y + dy) {
+    rays.org_ray_w(x, y + dy, &org);
+    rays.ray_w(x, y + dy, &dir);
+    if (PlaneBarycentric(v0, e1, e2, org, dir, &u_n, &v_n)) {
+      derivatives[2] = (u_n - u) * dy;
+      derivatives[3] = (v_n - v) * dy;
+    }
+  }
 }
 
-inline DiffuseVertexColorColorizer::DiffuseVertexColorColorizer() {}
-inline DiffuseVertexColorColorizer::~DiffuseVertexColorColorizer() {}
-inline void DiffuseVertexColorColorizer::Process(
-    const PixelShaderInput& input) const {
-  Image3b* color = input.color;
-  int x = input.x;
-  int y = input.y;
-  float u = input.u;
-  float v = input.v;
-  uint32_t face_index = input.face_index;
-  std::shared_ptr<const Mesh> mesh = input.mesh;
-
-  const auto& vertex_colors = mesh->vertex_colors();
-  const auto& faces = mesh->vertex_indices();
-  Eigen::Vector3f interp_color;
-  // barycentric interpolation of vertex color
-  interp_color = (1.0f - u - v) * vertex_colors[faces[face_index][0]] +
-                 u * vertex_colors[faces[face_index][1]] +
-                 v * vertex_colors[faces[face_index][2]];
-
-  Vec3b& c = color->at<Vec3b>(y, x);
-  for (int k = 0; k < 3; k++) {
-    c[k] = static_cast<unsigned char>(interp_color[k]);
-  }
+// Texel access of row-major texture of mesh and its tiled copy
+inline int TextureCols(const Image3b& texture) { return texture.cols; }
+inline int TextureRows(const Image3b& texture) { return texture.rows; }
+inline const uint8_t* Texel(const Image3b& texture, int y, int x) {
+  return &texture.at<Vec3b>(y, x)[0];
+}
+inline int TextureCols(const TiledTexture& texture) { return texture.cols(); }
+inline int TextureRows(const TiledTexture& texture) { return texture.rows(); }
+inline const uint8_t* Texel(const TiledTexture& texture, int y, int x) {
+  return texture.at(y, x);
 }
 
-inline DiffuseTextureNnColorizer::DiffuseTextureNnColorizer() {}
-inline DiffuseTextureNnColorizer::~DiffuseTextureNnColorizer() {}
-inline void DiffuseTextureNnColorizer::Process(
-    const PixelShaderInput& input) const {
-  Image3b* color = input.color;
-  int x = input.x;
-  int y = input.y;
-  float u = input.u;
-  float v = input.v;
-  uint32_t face_index = input.face_index;
-  std::shared_ptr<const Mesh> mesh = input.mesh;
-
-  const auto& uv = mesh->uv();
-  const auto& uv_indices = mesh->uv_indices();
-  int material_index = mesh->material_ids()[face_index];
-  const auto& diffuse_texture = mesh->materials()[material_index].diffuse_tex;
-
-  Eigen::Vector3f interp_color;
-  // barycentric interpolation of uv
-  Eigen::Vector2f interp_uv = (1.0f - u - v) * uv[uv_indices[face_index][0]] +
-                              u * uv[uv_indices[face_index][1]] +
-                              v * uv[uv_indices[face_index][2]];
-  float f_tex_pos[2];
-  f_tex_pos[0] = interp_uv[0] * (diffuse_texture.cols - 1);
-  f_tex_pos[1] = (1.0f - interp_uv[1]) * (diffuse_texture.rows - 1);
-
-  int tex_pos[2] = {0, 0};
-  // get nearest integer index by round
-  tex_pos[0] = static_cast<int>(std::round(f_tex_pos[0]));
-  tex_pos[1] = static_cast<int>(std::round(f_tex_pos[1]));
-
-  const Vec3b& dt = diffuse_texture.at<Vec3b>(tex_pos[1], tex_pos[0]);
-  for (int k = 0; k < 3; k++) {
-    interp_color[k] = dt[k];
-  }
+// Nearest texel at texture position (x, y) clamped to texture
+template <typename Texture>
+inline const uint8_t* SampleNearest(const Texture& texture, float x,
+                                    float y) {
+  const int cols = TextureCols(texture);
+  const int rows = TextureRows(texture);
+  const int ix = std::min(std::max(static_cast<int>(std::round(x)), 0),
+                          cols - 1);
+  const int iy = std::min(std::max(static_cast<int>(std::round(y)), 0),
+                          rows - 1);
+  return Texel(texture, iy, ix);
+}
 
-  Vec3b& c = color->at<Vec3b>(y, x);
+// Bilinear sampling at texture position (x, y) clamped to texture
+template <typename Texture>
+inline void SampleBilinear(const Texture& texture, float x, float y,
+                           float color[3]) {
+  const int cols = TextureCols(texture);
+  const int rows = TextureRows(texture);
+  x = std::min(std::max(x, 0.0f), static_cast<float>(cols - 1));
+  y = std::min(std::max(y, 0.0f), static_cast<float>(rows - 1));
+  const int x0 = static_cast<int>(x);
+  const int y0 = static_cast<int>(y);
+  const int x1 = std::min(x0 + 1, cols - 1);
+  const int y1 = std::min(y0 + 1, rows - 1);
+  const float local_u = x - x0;
+  const float local_v = y - y0;
+  const uint8_t* c00 = Texel(texture, y0, x0);
+  const uint8_t* c01 = Texel(texture, y0, x1);
+  const uint8_t* c10 = Texel(texture, y1, x0);
+  const uint8_t* c11 = Texel(texture, y1, x1);
   for (int k = 0; k < 3; k++) {
-    c[k] = static_cast<unsigned char>(interp_color[k]);
+    color[k] = (1.0f - local_u) * (1.0f - local_v) * c00[k] +
+               local_u * (1.0f - local_v) * c01[k] +
+               (1.0f - local_u) * local_v * c10[k] +
+               local_u * local_v * c11[k];
   }
 }
 
-inline DiffuseTextureBilinearColorizer::DiffuseTextureBilinearColorizer() {}
-inline DiffuseTextureBilinearColorizer::~DiffuseTextureBilinearColorizer() {}
-inline void DiffuseTextureBilinearColorizer::Process(
-    const PixelShaderInput& input) const {
-  Image3b* color = input.color;
-  int x = input.x;
-  int y = input.y;
-  float u = input.u;
-  float v = input.v;
-  uint32_t face_index = input.face_index;
-  std::shared_ptr<const Mesh> mesh = input.mesh;
-
-  const auto& uv = mesh->uv();
-  const auto& uv_indices = mesh->uv_indices();
-  int material_index = mesh->material_ids()[face_index];
-  const auto& diffuse_texture = mesh->materials()[material_index].diffuse_tex;
-
-  Eigen::Vector3f interp_color;
-
-  // barycentric interpolation of uv
-  Eigen::Vector2f interp_uv = (1.0f - u - v) * uv[uv_indices[face_index][0]] +
-                              u * uv[uv_indices[face_index][1]] +
-                              v * uv[uv_indices[face_index][2]];
-  float f_tex_pos[2];
-  f_tex_pos[0] = interp_uv[0] * (diffuse_texture.cols - 1);
-  f_tex_pos[1] = (1.0f - interp_uv[1]) * (diffuse_texture.rows - 1);
-
-  int tex_pos_min[2] = {0, 0};
-  int tex_pos_max[2] = {0, 0};
-  tex_pos_min[0] = static_cast<int>(std::floor(f_tex_pos[0]));
-  tex_pos_min[1] = static_cast<int>(std::floor(f_tex_pos[1]));
-  tex_pos_max[0] = tex_pos_min[0] + 1;
-  tex_pos_max[1] = tex_pos_min[1] + 1;
-
-  float local_u = f_tex_pos[0] - tex_pos_min[0];
-  float local_v = f_tex_pos[1] - tex_pos_min[1];
-
-  const Vec3b& dt_minmin =
-      diffuse_texture.at<Vec3b>(tex_pos_min[1], tex_pos_min[0]);
-  const Vec3b& dt_maxmin =
-      diffuse_texture.at<Vec3b>(tex_pos_min[1], tex_pos_max[0]);
-  const Vec3b& dt_minmax =
-      diffuse_texture.at<Vec3b>(tex_pos_max[1], tex_pos_min[0]);
-  const Vec3b& dt_maxmax =
-      diffuse_texture.at<Vec3b>(tex_pos_max[1], tex_pos_max[0]);
-  for (int k = 0; k < 3; k++) {
-    // bilinear interpolation of pixel color
-    interp_color[k] = (1.0f - local_u) * (1.0f - local_v) * dt_minmin[k] +
-                      local_u * (1.0f - local_v) * dt_maxmin[k] +
-                      (1.0f - local_u) * local_v * dt_minmax[k] +
-                      local_u * local_v * dt_maxmax[k];
+// Texture position of uv interpolated in face
+inline void TexturePosition(const ShadingContext& context, uint32_t face_index,
+                            float u, float v, int cols, int rows,
+                            float f_tex_pos[2]) {
+  const Eigen::Vector2f* uv = context.uv;
+  const Eigen::Vector3i& uv_index = context.uv_indices[face_index];
+  f_tex_pos[0] = ((1.0f - u - v) * uv[uv_index[0]][0] +
+                  u * uv[uv_index[1]][0] + v * uv[uv_index[2]][0]) *
+                 (cols - 1);
+  f_tex_pos[1] = (1.0f - ((1.0f - u - v) * uv[uv_index[0]][1] +
+                          u * uv[uv_index[1]][1] + v * uv[uv_index[2]][1])) *
+                 (rows - 1);
+}
 
-    assert(0.0f <= interp_color[k] && interp_color[k] <= 255.0f);
+inline void PixelShader::Flush(ShadingBatch* batch, Image3b* color) const {
+  if (batch->size > 0) {
+    Process(*batch, color);
   }
+  batch->size = 0;
+}
 
-  Vec3b& c = color->at<Vec3b>(y, x);
+inline void DiffuseDefaultColorizer::Process(const ShadingBatch& batch,
+                                             BatchColor c) {
   for (int k = 0; k < 3; k++) {
-    c[k] = static_cast<unsigned char>(interp_color[k]);
+    for (int j = 0; j < batch.size; j++) {
+      c[k][j] = 255;
+    }
   }
 }
 
-inline DiffuseDefaultShader::DiffuseDefaultShader() {}
-inline DiffuseDefaultShader::~DiffuseDefaultShader() {}
-inline void DiffuseDefaultShader::Process(const PixelShaderInput& input) const {
-  // do nothing.
-  (void)input;
+inline void DiffuseVertexColorColorizer::Process(const ShadingBatch& batch,
+                                                 BatchColor c) {
+  const Eigen::Vector3f* vertex_colors = batch.context->vertex_colors;
+  const Eigen::Vector3i* faces = batch.context->faces;
+  for (int j = 0; j < batch.size; j++) {
+    const float u = batch.u[j];
+    const float v = batch.v[j];
+    const Eigen::Vector3i& face = faces[batch.face_index[j]];
+    // barycentric interpolation of vertex color
+    for (int k = 0; k < 3; k++) {
+      const float interp_color = (1.0f - u - v) * vertex_colors[face[0]][k] +
+                                 u * vertex_colors[face[1]][k] +
+                                 v * vertex_colors[face[2]][k];
+      c[k][j] = static_cast<unsigned char>(interp_color);
+    }
+  }
 }
 
-inline DiffuseLambertianShader::DiffuseLambertianShader() {}
-inline DiffuseLambertianShader::~DiffuseLambertianShader() {}
-inline void DiffuseLambertianShader::Process(
-    const PixelShaderInput& input) const {
-  Image3b* color = input.color;
-  int x = input.x;
-  int y = input.y;
+inline void DiffuseTextureNnColorizer::Process(const ShadingBatch& batch,
+                                               BatchColor c) {
+  const ShadingContext& context = *batch.context;
+  const bool tiled = !context.mipmaps.empty();
+  for (int j = 0; j < batch.size; j++) {
+    const uint32_t face_index = batch.face_index[j];
+    const int material_index = context.material_ids[face_index];
+    const Image3b& diffuse_texture = *context.diffuse_textures[material_index];
+
+    // barycentric interpolation of uv
+    float f_tex_pos[2];
+    TexturePosition(context, face_index, batch.u[j], batch.v[j],
+                    diffuse_texture.cols, diffuse_texture.rows, f_tex_pos);
+
+    // get nearest integer index by round
+    const uint8_t* dt =
+        tiled ? SampleNearest(context.mipmaps[material_index]->level(0),
+                              f_tex_pos[0], f_tex_pos[1])
+              : SampleNearest(diffuse_texture, f_tex_pos[0], f_tex_pos[1]);
+    for (int k = 0; k < 3; k++) {
+      c[k][j] = dt[k];
+    }
+  }
+}
+
+inline void DiffuseTextureBilinearColorizer::Process(const ShadingBatch& batch,
+                                                     BatchColor c) {
+  const ShadingContext& context = *batch.context;
+  const bool tiled = !context.mipmaps.empty();
+  for (int j = 0; j < batch.size; j++) {
+    const uint32_t face_index = batch.face_index[j];
+    const int material_index = context.material_ids[face_index];
+    const Image3b& diffuse_texture = *context.diffuse_textures[material_index];
 
-  // dot product of normal and inverse light direction
-  float coeff = -input.light_dir->dot(*input.shading_normal);
+    // barycentric interpolation of uv
+    float f_tex_pos[2];
+    TexturePosition(context, face_index, batch.u[j], batch.v[j],
+                    diffuse_texture.cols, diffuse_texture.rows, f_tex_pos);
 
-  // if negative (may happen at back-face or occluding boundary), bound to 0
-  if (coeff < 0.0f) {
-    coeff = 0.0f;
+    // bilinear interpolation of pixel color
+    float interp_color[3];
+    if (tiled) {
+      SampleBilinear(context.mipmaps[material_index]->level(0), f_tex_pos[0],
+                     f_tex_pos[1], interp_color);
+    } else {
+      SampleBilinear(diffuse_texture, f_tex_pos[0], f_tex_pos[1],
+                     interp_color);
+    }
+    for (int k = 0; k < 3; k++) {
+      assert(0.0f <= interp_color[k] && interp_color[k] <= 255.0f);
+      c[k][j] = static_cast<unsigned char>(interp_color[k]);
+    }
   }
+}
 
-  Vec3b& c = color->at<Vec3b>(y, x);
+inline void DiffuseTextureTrilinearColorizer::Process(
+    const ShadingBatch& batch, BatchColor c) {
+  const ShadingContext& context = *batch.context;
+  const Eigen::Vector2f* uv = context.uv;
+  const Eigen::Vector3i* uv_indices = context.uv_indices;
+  for (int j = 0; j < batch.size; j++) {
+    const float u = batch.u[j];
+    const float v = batch.v[j];
+    const uint32_t face_index = batch.face_index[j];
+    const Mipmap& mipmap = *context.mipmaps[context.material_ids[face_index]];
+    const TiledTexture& level0 = mipmap.level(0);
+
+    // barycentric interpolation of uv and its derivatives
+    const Eigen::Vector3i& uv_index = uv_indices[face_index];
+    const Eigen::Vector2f& uv0 = uv[uv_index[0]];
+    const Eigen::Vector2f e1 = uv[uv_index[1]] - uv0;
+    const Eigen::Vector2f e2 = uv[uv_index[2]] - uv0;
+    const Eigen::Vector2f interp_uv = uv0 + u * e1 + v * e2;
+    const Eigen::Vector2f uv_dx =
+        batch.uv_dx[0][j] * e1 + batch.uv_dx[1][j] * e2;
+    const Eigen::Vector2f uv_dy =
+        batch.uv_dy[0][j] * e1 + batch.uv_dy[1][j] * e2;
+
+    // level of detail from the longer footprint of pixel in texels
+    const Eigen::Vector2f size(static_cast<float>(level0.cols()),
+                               static_cast<float>(level0.rows()));
+    const float footprint = std::max(uv_dx.cwiseProduct(size).squaredNorm(),
+                                     uv_dy.cwiseProduct(size).squaredNorm());
+    const float max_lod = static_cast<float>(mipmap.num_levels() - 1);
+    const float lod =
+        footprint > 1.0f ? std::min(0.5f * std::log2(footprint), max_lod)
+                         : 0.0f;
+    const int lod0 = static_cast<int>(lod);
+    const int lod1 = std::min(lod0 + 1, mipmap.num_levels() - 1);
+    const float t = lod - lod0;
+
+    // bilinear interpolation in two levels. finer one only if on it
+    float interp_color[2][3] = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+    const int lods[2] = {lod0, lod1};
+    for (int i = 0; i < (t > 0.0f ? 2 : 1); i++) {
+      const TiledTexture& texture = mipmap.level(lods[i]);
+      SampleBilinear(texture, interp_uv[0] * (texture.cols() - 1),
+                     (1.0f - interp_uv[1]) * (texture.rows() - 1),
+                     interp_color[i]);
+    }
+    for (int k = 0; k < 3; k++) {
+      const float color =
+          (1.0f - t) * interp_color[0][k] + t * interp_color[1][k];
+      c[k][j] = static_cast<unsigned char>(std::min(color, 255.0f));
+    }
+  }
+}
+
+inline void DiffuseDefaultShader::Process(const ShadingBatch& batch,
+                                          BatchColor c) {
+  // do nothing.
+  (void)batch;
+  (void)c;
+}
+
+// Raw view of batch for lighting kernels
+inline ShadeInput MakeShadeInput(const ShadingBatch& batch) {
+  ShadeInput input;
   for (int k = 0; k < 3; k++) {
-    c[k] = static_cast<uint8_t>(coeff * c[k]);
+    input.normal[k] = batch.shading_normal[k];
+    input.light[k] = batch.ray_w[k];
+    input.ray[k] = batch.ray_w[k];
   }
+  input.size = batch.size;
+  input.oren_nayar_a = batch.context->oren_nayar_param.A;
+  input.oren_nayar_b = batch.context->oren_nayar_param.B;
+  return input;
 }
 
-inline DiffuseOrenNayarShader::DiffuseOrenNayarShader() {}
-inline DiffuseOrenNayarShader::~DiffuseOrenNayarShader() {}
-inline void DiffuseOrenNayarShader::Process(
-    const PixelShaderInput& input) const {
-  // angle against normal
-  float dot_light = -input.light_dir->dot(*input.shading_normal);
-  float theta_i = std::acos(dot_light);
-  float dot_ray = -input.ray_w->dot(*input.shading_normal);
-  float theta_r = std::acos(dot_ray);
-
-  // angle against binormal (perpendicular to normal)
-  Eigen::Vector3f binormal_light =
-      -*input.shading_normal * dot_light - *input.light_dir;
-  Eigen::Vector3f binormal_ray =
-      -*input.shading_normal * dot_light - *input.ray_w;
-  float phi_diff_cos = std::max(0.0f, binormal_light.dot(binormal_ray));
-
-  float alpha = std::max(theta_i, theta_r);
-  float beta = std::min(theta_i, theta_r);
-
-  float A = input.oren_nayar_param->A;
-  float B = input.oren_nayar_param->B;
-  float coeff = std::max(0.0f, dot_light) *
-                (A + (B * phi_diff_cos * std::sin(alpha) * std::tan(beta)));
-
-  Image3b* color = input.color;
-  int x = input.x;
-  int y = input.y;
-  Vec3b& c = color->at<Vec3b>(y, x);
+inline void ModulateColor(const ShadingBatch& batch,
+                          const float coeff[kShadingBatchSize], BatchColor c) {
   for (int k = 0; k < 3; k++) {
-    c[k] = static_cast<uint8_t>(coeff * c[k]);
+    for (int j = 0; j < batch.size; j++) {
+      c[k][j] = static_cast<uint8_t>(coeff[j] * c[k][j]);
+    }
   }
 }
 
+inline void DiffuseLambertianShader::Process(const ShadingBatch& batch,
+                                             BatchColor c) {
+  // CPU never changes during execution, so select only once
+  static const ShadeKernel kernel = GetShadeKernel(ShadeModel::kLambertian);
+  float coeff[kShadingBatchSize];
+  kernel(MakeShadeInput(batch), coeff);
+  ModulateColor(batch, coeff, c);
+}
+
+inline void DiffuseOrenNayarShader::Process(const ShadingBatch& batch,
+                                            BatchColor c) {
+  static const ShadeKernel kernel = GetShadeKernel(ShadeModel::kOrenNayar);
+  float coeff[kShadingBatchSize];
+  kernel(MakeShadeInput(batch), coeff);
+  ModulateColor(batch, coeff, c);
+}
+
 }  // namespace currender
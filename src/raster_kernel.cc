@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "src/raster_kernel.h"
+#include "src/shade_kernel.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#include "src/raster_kernel_impl.h"
+#include "src/shade_kernel_impl.h"
+#include "src/util_private.h"
+
+namespace {
+
+enum class Isa { kSse41, kAvx2, kAvx512 };
+
+// Checks both of CPU and OS (saving extended registers) support
+bool CpuSupports(Isa isa) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (isa == Isa::kSse41) {
+    return __builtin_cpu_supports("sse4.1") != 0;
+  } else if (isa == Isa::kAvx2) {
+    return __builtin_cpu_supports("avx2") != 0;
+  } else if (isa == Isa::kAvx512) {
+    return __builtin_cpu_supports("avx512f") != 0;
+  }
+  return false;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+  __cpuid(info, 1);
+  const bool sse41 = (info[2] & (1 << 19)) != 0;
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool avx = (info[2] & (1 << 28)) != 0;
+  if (isa == Isa::kSse41) {
+    return sse41;
+  }
+  if (!osxsave || !avx || max_leaf < 7) {
+    return false;
+  }
+  const unsigned long long xcr0 = _xgetbv(0);
+  __cpuidex(info, 7, 0);
+  if (isa == Isa::kAvx2) {
+    // XMM and YMM states
+    return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+  } else if (isa == Isa::kAvx512) {
+    // XMM, YMM, opmask and ZMM states
+    return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+  }
+  return false;
+#else
+  (void)isa;
+  return false;
+#endif
+}
+
+}  // namespace
+
+namespace currender {
+
+RasterKernel GetRasterKernelScalar(RasterOutput output) {
+  return SelectRasterKernel<ScalarOps>(output);
+}
+
+RasterKernel GetRasterKernel(RasterOutput output, const char** name) {
+  typedef RasterKernel (*KernelGetter)(RasterOutput);
+
+  // CPU never changes during execution, so check only once
+  static const char* kernel_name = nullptr;
+  static KernelGetter getter = []() {
+    const RasterOutput any = RasterOutput::kFull;
+    KernelGetter selected = nullptr;
+    if (CpuSupports(Isa::kAvx512) && GetRasterKernelAvx512(any) != nullptr) {
+      selected = &GetRasterKernelAvx512;
+      kernel_name = "AVX-512";
+    } else if (CpuSupports(Isa::kAvx2) &&
+               GetRasterKernelAvx2(any) != nullptr) {
+      selected = &GetRasterKernelAvx2;
+      kernel_name = "AVX2";
+    } else if (CpuSupports(Isa::kSse41) &&
+               GetRasterKernelSse41(any) != nullptr) {
+      selected = &GetRasterKernelSse41;
+      kernel_name = "SSE4.1";
+    } else {
+      selected = &GetRasterKernelScalar;
+      kernel_name = "Scalar";
+    }
+    LOGI("Rasterization kernel: %s\n", kernel_name);
+    return selected;
+  }();
+
+  if (name != nullptr) {
+    *name = kernel_name;
+  }
+  return getter(output);
+}
+
+ShadeKernel GetShadeKernelScalar(ShadeModel model) {
+  return SelectShadeKernel<ScalarOps>(model);
+}
+
+ShadeKernel GetShadeKernel(ShadeModel model, const char** name) {
+  typedef ShadeKernel (*KernelGetter)(ShadeModel);
+
+  // CPU never changes during execution, so check only once
+  static const char* kernel_name = nullptr;
+  static KernelGetter getter = []() {
+    const ShadeModel any = ShadeModel::kLambertian;
+    KernelGetter selected = nullptr;
+    if (CpuSupports(Isa::kAvx512) && GetShadeKernelAvx512(any) != nullptr) {
+      selected = &GetShadeKernelAvx512;
+      kernel_name = "AVX-512";
+    } else if (CpuSupports(Isa::kAvx2) && GetShadeKernelAvx2(any) != nullptr) {
+      selected = &GetShadeKernelAvx2;
+      kernel_name = "AVX2";
+    } else if (CpuSupports(Isa::kSse41) &&
+               GetShadeKernelSse41(any) != nullptr) {
+      selected = &GetShadeKernelSse41;
+      kernel_name = "SSE4.1";
+    } else {
+      selected = &GetShadeKernelScalar;
+      kernel_name = "Scalar";
+    }
+    return selected;
+  }();
+
+  if (name != nullptr) {
+    *name = kernel_name;
+  }
+  return getter(model);
+}
+
+}  // namespace currender
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+// Kernels to rasterize triangles into a screen tile.
+// Vectorized versions are compiled in separated translation units with
+// instruction set specific flags and the best one for running CPU is selected
+// at runtime. Thus this header must not depend on anything but plain types.
+
+#include <cstdint>
+
+namespace currender {
+
+// Tile passed to kernels must not be larger than this
+const int kRasterMaxTileSize = 64;
+
+// Raw view of triangle setup (structure of arrays)
+// Edge function k is w_k = a[k] * (x - x0) + b[k] * (y - y0) + c[k], which is
+// non-negative for all k inside of triangle. Depth is 1 / (w_0 + w_1 + w_2).
+struct RasterTriangles {
+  const float* a[3];
+  const float* b[3];
+  const float* c[3];
+  const int* x0;
+  const int* y0;
+  const int* x1;
+  const int* y1;
+  const float* z_min;  // minimum depth of vertices
+  const float* z_max;  // maximum depth of vertices
+  const int* face_id;
+  const unsigned char* backface;  // 255: backface, 0:frontface
+};
+
+// Raw view of z-buffer images. All images have the same size.
+// depth has negative value if the nearest face is backface.
+// Pixels whose depth is out of [near, far] are clipped.
+struct RasterTarget {
+  float* depth;
+  int* face_id;
+  float* weight[3];  // perspective-correct barycentric
+  int stride;        // number of elements in a row
+  float inv_near;    // 1 / near
+  float inv_far;     // 1 / far
+};
+
+// Counters of work rejected by kernels. Added up by kernels.
+struct RasterStats {
+  int64_t tile_tests;
+  int64_t tile_depth_rejected;
+  int64_t block_tests;
+  int64_t block_edge_rejected;
+  int64_t block_depth_rejected;
+  int64_t block_depth_accepted;
+};
+
+// Buffers written by kernels
+enum class RasterOutput {
+  kCoverage = 0,  // 1 to depth of covered pixels without depth test
+  kDepth = 1,     // depth
+  kFaceId = 2,    // depth and face id
+  kFull = 3       // depth, face id and weight
+};
+
+// Rasterize triangles listed in bin into a tile [tile_x0, tile_x1] x
+// [tile_y0, tile_y1]. Triangles are processed in the order of bin.
+// All kernels give bit-identical results.
+// Buffers of target not written by the kernel may be nullptr.
+typedef void (*RasterKernel)(const RasterTriangles& triangles, const int* bin,
+                             int bin_size, int tile_x0, int tile_y0,
+                             int tile_x1, int tile_y1,
+                             const RasterTarget& target, RasterStats* stats);
+
+// Each returns nullptr if the kernel is not compiled
+RasterKernel GetRasterKernelScalar(RasterOutput output);
+RasterKernel GetRasterKernelSse41(RasterOutput output);
+RasterKernel GetRasterKernelAvx2(RasterOutput output);
+RasterKernel GetRasterKernelAvx512(RasterOutput output);
+
+// Returns the fastest kernel supported by running CPU
+// name is set if not nullptr
+RasterKernel GetRasterKernel(RasterOutput output, const char** name = nullptr);
+
+}  // namespace currender
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+// Compiled with AVX2 flag (e.g. -mavx2, /arch:AVX2)
+
+#include "src/raster_kernel.h"
+#include "src/shade_kernel.h"
+
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+#include "src/raster_kernel_impl.h"
+#include "src/shade_kernel_impl.h"
+
+namespace currender {
+namespace {
+
+struct Avx2Ops {
+  static const int kWidth = 8;
+  typedef __m256 F;
+  typedef __m256i I;
+  typedef __m256 M;
+
+  static F Set1(float v) { return _mm256_set1_ps(v); }
+  static F Iota() {
+    return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+  }
+  static F Add(F a, F b) { return _mm256_add_ps(a, b); }
+  static F Sub(F a, F b) { return _mm256_sub_ps(a, b); }
+  static F Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+  static F Div(F a, F b) { return _mm256_div_ps(a, b); }
+  static F Sqrt(F a) { return _mm256_sqrt_ps(a); }
+  static F Abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+  static F Min(F a, F b) { return _mm256_min_ps(a, b); }
+  static F Max(F a, F b) { return _mm256_max_ps(a, b); }
+  static float ReduceMin(F a) {
+    __m128 v =
+        _mm_min_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_min_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+  }
+  static float ReduceMax(F a) {
+    __m128 v =
+        _mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+  }
+  static M CmpGe(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+  static M CmpLt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static M And(M a, M b) { return _mm256_and_ps(a, b); }
+  static M Or(M a, M b) { return _mm256_or_ps(a, b); }
+  static bool Any(M m) { return _mm256_movemask_ps(m) != 0; }
+  static F Load(const float* p) { return _mm256_loadu_ps(p); }
+  static void Store(float* p, F v) { _mm256_storeu_ps(p, v); }
+  static F Select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+  static I Set1I(int v) { return _mm256_set1_epi32(v); }
+  static I LoadI(const int* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  }
+  static void StoreI(int* p, I v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+  }
+  static I SelectI(M m, I a, I b) {
+    return _mm256_castps_si256(
+        _mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m));
+  }
+};
+
+}  // namespace
+
+RasterKernel GetRasterKernelAvx2(RasterOutput output) {
+  return SelectRasterKernel<Avx2Ops>(output);
+}
+
+ShadeKernel GetShadeKernelAvx2(ShadeModel model) {
+  return SelectShadeKernel<Avx2Ops>(model);
+}
+
+}  // namespace currender
+
+#else
+
+namespace currender {
+
+RasterKernel GetRasterKernelAvx2(RasterOutput) { return nullptr; }
+
+ShadeKernel GetShadeKernelAvx2(ShadeModel) { return nullptr; }
+
+}  // namespace currender
+
+#endif
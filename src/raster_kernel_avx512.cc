@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+// Compiled with AVX-512F flag (e.g. -mavx512f, /arch:AVX512)
+
+#include "src/raster_kernel.h"
+#include "src/shade_kernel.h"
+
+#ifdef __AVX512F__
+
+// _mm512_undefined_ps() in intrinsics is falsely warned by some GCC versions
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+#include <immintrin.h>
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#include "src/raster_kernel_impl.h"
+#include "src/shade_kernel_impl.h"
+
+namespace currender {
+namespace {
+
+struct Avx512Ops {
+  static const int kWidth = 16;
+  typedef __m512 F;
+  typedef __m512i I;
+  typedef __mmask16 M;
+
+  static F Set1(float v) { return _mm512_set1_ps(v); }
+  static F Iota() {
+    return _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f,
+                          8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f,
+                          15.0f);
+  }
+  static F Add(F a, F b) { return _mm512_add_ps(a, b); }
+  static F Sub(F a, F b) { return _mm512_sub_ps(a, b); }
+  static F Mul(F a, F b) { return _mm512_mul_ps(a, b); }
+  static F Div(F a, F b) { return _mm512_div_ps(a, b); }
+  static F Sqrt(F a) { return _mm512_sqrt_ps(a); }
+  static F Abs(F a) { return _mm512_abs_ps(a); }
+  static F Min(F a, F b) { return _mm512_min_ps(a, b); }
+  static F Max(F a, F b) { return _mm512_max_ps(a, b); }
+  static float ReduceMin(F a) { return _mm512_reduce_min_ps(a); }
+  static float ReduceMax(F a) { return _mm512_reduce_max_ps(a); }
+  static M CmpGe(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+  static M CmpLt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static M And(M a, M b) { return static_cast<M>(a & b); }
+  static M Or(M a, M b) { return static_cast<M>(a | b); }
+  static bool Any(M m) { return m != 0; }
+  static F Load(const float* p) { return _mm512_loadu_ps(p); }
+  static void Store(float* p, F v) { _mm512_storeu_ps(p, v); }
+  static F Select(M m, F a, F b) { return _mm512_mask_blend_ps(m, b, a); }
+  static I Set1I(int v) { return _mm512_set1_epi32(v); }
+  static I LoadI(const int* p) { return _mm512_loadu_si512(p); }
+  static void StoreI(int* p, I v) { _mm512_storeu_si512(p, v); }
+  static I SelectI(M m, I a, I b) { return _mm512_mask_blend_epi32(m, b, a); }
+};
+
+}  // namespace
+
+RasterKernel GetRasterKernelAvx512(RasterOutput output) {
+  return SelectRasterKernel<Avx512Ops>(output);
+}
+
+ShadeKernel GetShadeKernelAvx512(ShadeModel model) {
+  return SelectShadeKernel<Avx512Ops>(model);
+}
+
+}  // namespace currender
+
+#else
+
+namespace currender {
+
+RasterKernel GetRasterKernelAvx512(RasterOutput) { return nullptr; }
+
+ShadeKernel GetShadeKernelAvx512(ShadeModel) { return nullptr; }
+
+}  // namespace currender
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+// Template of tile rasterization kernel shared by all instruction sets.
+// This header is included by each raster_kernel_*.cc which is compiled with
+// its own instruction set flags. Everything is put into an unnamed namespace
+// and does not use inline functions of other libraries (e.g. std::min) so that
+// no function compiled with an extended instruction set is shared with the
+// other translation units by the linker.
+
+#include <cfloat>
+#include <math.h>  // sqrtf of C library, not inline std::sqrt
+
+#include "src/raster_kernel.h"
+
+namespace currender {
+namespace {
+
+// Pixel block size. Edge functions are tested at the block corners to reject
+// whole blocks outside of triangle before per-pixel work.
+const int kRasterBlockWidth = 16;
+const int kRasterBlockHeight = 8;
+
+// Relative margin of hierarchical z test to absorb rounding error of depth
+// interpolated in pixels. Keeps results identical with and without the test.
+const float kRasterDepthMargin = 1.0e-3f;
+
+inline int RasterMin(int a, int b) { return a < b ? a : b; }
+inline int RasterMax(int a, int b) { return a < b ? b : a; }
+inline float RasterMin(float a, float b) { return a < b ? a : b; }
+inline float RasterMax(float a, float b) { return a < b ? b : a; }
+
+// Scalar operations with the same interface as vector ones.
+// Used as a kernel itself and for remaining pixels of vectorized kernels.
+struct ScalarOps {
+  static const int kWidth = 1;
+  typedef float F;
+  typedef int I;
+  typedef bool M;
+
+  static F Set1(float v) { return v; }
+  static F Iota() { return 0.0f; }
+  static F Add(F a, F b) { return a + b; }
+  static F Sub(F a, F b) { return a - b; }
+  static F Mul(F a, F b) { return a * b; }
+  static F Div(F a, F b) { return a / b; }
+  static F Sqrt(F a) { return sqrtf(a); }
+  static F Abs(F a) { return a < 0.0f ? -a : a; }
+  static F Min(F a, F b) { return a < b ? a : b; }
+  static F Max(F a, F b) { return a < b ? b : a; }
+  static float ReduceMin(F a) { return a; }
+  static float ReduceMax(F a) { return a; }
+  static M CmpGe(F a, F b) { return a >= b; }
+  static M CmpLt(F a, F b) { return a < b; }
+  static M And(M a, M b) { return a && b; }
+  static M Or(M a, M b) { return a || b; }
+  static bool Any(M m) { return m; }
+  static F Load(const float* p) { return *p; }
+  static void Store(float* p, F v) { *p = v; }
+  static F Select(M m, F a, F b) { return m ? a : b; }
+  static I Set1I(int v) { return v; }
+  static I LoadI(const int* p) { return *p; }
+  static void StoreI(int* p, I v) { *p = v; }
+  static I SelectI(M m, I a, I b) { return m ? a : b; }
+};
+
+// Process Ops::kWidth pixels from (x, y)
+// w_row[k] is edge function k at (x0, y) of triangle and dx is x - x0
+// If depth_test is false, covered pixels are written without depth test
+// Returns true if any pixel is written
+template <typename Ops, RasterOutput kOutput>
+inline bool RasterizePixels(const float w_row[3], const float a[3], float dx,
+                            float sign, int face_id, bool depth_test, int x,
+                            int y, const RasterTarget& target) {
+  typedef typename Ops::F F;
+  typedef typename Ops::M M;
+
+  const F zero = Ops::Set1(0.0f);
+  const F dx_v = Ops::Add(Ops::Set1(dx), Ops::Iota());
+  const F w0 = Ops::Add(Ops::Set1(w_row[0]), Ops::Mul(Ops::Set1(a[0]), dx_v));
+  const F w1 = Ops::Add(Ops::Set1(w_row[1]), Ops::Mul(Ops::Set1(a[1]), dx_v));
+  const F w2 = Ops::Add(Ops::Set1(w_row[2]), Ops::Mul(Ops::Set1(a[2]), dx_v));
+
+  M mask = Ops::And(Ops::And(Ops::CmpGe(w0, zero), Ops::CmpGe(w1, zero)),
+                    Ops::CmpGe(w2, zero));
+  if (!Ops::Any(mask)) {
+    return false;
+  }
+
+  // near and far clipping. sum of edge functions is 1 / depth
+  const F inv_z = Ops::Add(Ops::Add(w0, w1), w2);
+  mask = Ops::And(mask, Ops::And(Ops::CmpGe(Ops::Set1(target.inv_near), inv_z),
+                                 Ops::CmpGe(inv_z, Ops::Set1(target.inv_far))));
+  if (!Ops::Any(mask)) {
+    return false;
+  }
+
+  const int offset = y * target.stride + x;
+  float* depth = target.depth + offset;
+  if (kOutput == RasterOutput::kCoverage) {
+    Ops::Store(depth, Ops::Select(mask, Ops::Set1(1.0f), Ops::Load(depth)));
+    return true;
+  }
+
+  /** Perspective-Correct Interpolation **/
+  const F z = Ops::Div(Ops::Set1(1.0f), inv_z);
+
+  if (depth_test) {
+    const F d = Ops::Abs(Ops::Load(depth));
+    mask = Ops::And(mask, Ops::Or(Ops::CmpLt(d, Ops::Set1(FLT_MIN)),
+                                  Ops::CmpLt(z, d)));
+    if (!Ops::Any(mask)) {
+      return false;
+    }
+  }
+
+  Ops::Store(depth, Ops::Select(mask, Ops::Mul(z, Ops::Set1(sign)),
+                                Ops::Load(depth)));
+  if (kOutput == RasterOutput::kDepth) {
+    return true;
+  }
+
+  int* fid = target.face_id + offset;
+  Ops::StoreI(fid, Ops::SelectI(mask, Ops::Set1I(face_id), Ops::LoadI(fid)));
+  if (kOutput == RasterOutput::kFaceId) {
+    return true;
+  }
+
+  float* weight0 = target.weight[0] + offset;
+  float* weight1 = target.weight[1] + offset;
+  float* weight2 = target.weight[2] + offset;
+  Ops::Store(weight0, Ops::Select(mask, Ops::Mul(w0, z), Ops::Load(weight0)));
+  Ops::Store(weight1, Ops::Select(mask, Ops::Mul(w1, z), Ops::Load(weight1)));
+  Ops::Store(weight2, Ops::Select(mask, Ops::Mul(w2, z), Ops::Load(weight2)));
+
+  return true;
+}
+
+// Computes depth range of pixels [x0, x1] x [y0, y1]
+// Empty pixel is regarded as infinitely far
+template <typename Ops>
+inline void DepthRange(const RasterTarget& target, int x0, int y0, int x1,
+                       int y1, float* z_min, float* z_max) {
+  typedef typename Ops::F F;
+  const F inf = Ops::Set1(FLT_MAX);
+  const F empty = Ops::Set1(FLT_MIN);
+  F min_v = inf;
+  F max_v = Ops::Set1(0.0f);
+  float min_s = FLT_MAX;
+  float max_s = 0.0f;
+  for (int y = y0; y <= y1; y++) {
+    const float* depth = target.depth + y * target.stride;
+    int x = x0;
+    for (; x + Ops::kWidth - 1 <= x1; x += Ops::kWidth) {
+      F d = Ops::Abs(Ops::Load(depth + x));
+      d = Ops::Select(Ops::CmpLt(d, empty), inf, d);
+      min_v = Ops::Min(min_v, d);
+      max_v = Ops::Max(max_v, d);
+    }
+    for (; x <= x1; x++) {
+      float d = ScalarOps::Abs(depth[x]);
+      d = d < FLT_MIN ? FLT_MAX : d;
+      min_s = RasterMin(min_s, d);
+      max_s = RasterMax(max_s, d);
+    }
+  }
+  *z_min = RasterMin(min_s, Ops::ReduceMin(min_v));
+  *z_max = RasterMax(max_s, Ops::ReduceMax(max_v));
+}
+
+template <typename Ops, RasterOutput kOutput>
+void RasterizeTile(const RasterTriangles& triangles, const int* bin,
+                   int bin_size, int tile_x0, int tile_y0, int tile_x1,
+                   int tile_y1, const RasterTarget& target,
+                   RasterStats* stats) {
+  // hierarchical z: depth range of blocks and the whole tile
+  // triangle farther than the maximum is occluded and rejected. if triangle is
+  // nearer than the minimum, per-pixel depth test always passes and is skipped
+  // coverage has no depth so that both are disabled
+  const bool use_depth = kOutput != RasterOutput::kCoverage;
+  const int kMaxBlocks = (kRasterMaxTileSize / kRasterBlockWidth) *
+                         (kRasterMaxTileSize / kRasterBlockHeight);
+  const int block_cols =
+      (tile_x1 - tile_x0 + kRasterBlockWidth) / kRasterBlockWidth;
+  const int block_rows =
+      (tile_y1 - tile_y0 + kRasterBlockHeight) / kRasterBlockHeight;
+  float block_z_min[kMaxBlocks];
+  float block_z_max[kMaxBlocks];
+  float tile_z_max = 0.0f;
+  for (int j = 0; j < block_rows && use_depth; j++) {
+    for (int i = 0; i < block_cols; i++) {
+      const int bx = tile_x0 + i * kRasterBlockWidth;
+      const int by = tile_y0 + j * kRasterBlockHeight;
+      const int b = j * block_cols + i;
+      DepthRange<Ops>(target, bx, by,
+                      RasterMin(bx + kRasterBlockWidth - 1, tile_x1),
+                      RasterMin(by + kRasterBlockHeight - 1, tile_y1),
+                      &block_z_min[b], &block_z_max[b]);
+      tile_z_max = RasterMax(tile_z_max, block_z_max[b]);
+    }
+  }
+
+  for (int n = 0; n < bin_size; n++) {
+    const int i = bin[n];
+
+    const float tri_z_min = triangles.z_min[i] * (1.0f - kRasterDepthMargin);
+    const float tri_z_max = triangles.z_max[i] * (1.0f + kRasterDepthMargin);
+    stats->tile_tests++;
+    if (use_depth && tri_z_min >= tile_z_max) {
+      stats->tile_depth_rejected++;
+      continue;
+    }
+
+    const int org_x = triangles.x0[i];
+    const int org_y = triangles.y0[i];
+    const int x0 = RasterMax(org_x, tile_x0);
+    const int x1 = RasterMin(triangles.x1[i], tile_x1);
+    const int y0 = RasterMax(org_y, tile_y0);
+    const int y1 = RasterMin(triangles.y1[i], tile_y1);
+    const float a[3] = {triangles.a[0][i], triangles.a[1][i],
+                        triangles.a[2][i]};
+    const float b[3] = {triangles.b[0][i], triangles.b[1][i],
+                        triangles.b[2][i]};
+    const float c[3] = {triangles.c[0][i], triangles.c[1][i],
+                        triangles.c[2][i]};
+    const int face_id = triangles.face_id[i];
+    const float sign = triangles.backface[i] != 0 ? -1.0f : 1.0f;
+
+    // blocks are aligned to tile origin
+    const int block_i_start = (x0 - tile_x0) / kRasterBlockWidth;
+    const int block_j_start = (y0 - tile_y0) / kRasterBlockHeight;
+    bool tile_updated = false;
+    for (int bj = block_j_start;
+         tile_y0 + bj * kRasterBlockHeight <= y1; bj++) {
+      const int by = tile_y0 + bj * kRasterBlockHeight;
+      const int by0 = RasterMax(by, y0);
+      const int by1 = RasterMin(by + kRasterBlockHeight - 1, y1);
+      const float dy0 = static_cast<float>(by0 - org_y);
+      const float dy1 = static_cast<float>(by1 - org_y);
+      for (int bi = block_i_start;
+           tile_x0 + bi * kRasterBlockWidth <= x1; bi++) {
+        const int bx = tile_x0 + bi * kRasterBlockWidth;
+        const int bx0 = RasterMax(bx, x0);
+        const int bx1 = RasterMin(bx + kRasterBlockWidth - 1, x1);
+        const float dx0 = static_cast<float>(bx0 - org_x);
+        const float dx1 = static_cast<float>(bx1 - org_x);
+        const int block = bj * block_cols + bi;
+
+        stats->block_tests++;
+
+        // edge function is linear so its maximum in block is at a corner.
+        // evaluated in the same order as pixels to be conservative
+        bool outside = false;
+        for (int k = 0; k < 3; k++) {
+          const float row_max = c[k] + RasterMax(b[k] * dy0, b[k] * dy1);
+          if (row_max + RasterMax(a[k] * dx0, a[k] * dx1) < 0.0f) {
+            outside = true;
+            break;
+          }
+        }
+        if (outside) {
+          stats->block_edge_rejected++;
+          continue;
+        }
+
+        if (use_depth && tri_z_min >= block_z_max[block]) {
+          stats->block_depth_rejected++;
+          continue;
+        }
+        const bool depth_test =
+            use_depth && tri_z_max >= block_z_min[block];
+        if (use_depth && !depth_test) {
+          stats->block_depth_accepted++;
+        }
+
+        bool written = false;
+        for (int y = by0; y <= by1; y++) {
+          const float dy = static_cast<float>(y - org_y);
+          const float w_row[3] = {c[0] + b[0] * dy, c[1] + b[1] * dy,
+                                  c[2] + b[2] * dy};
+          int x = bx0;
+          for (; x + Ops::kWidth - 1 <= bx1; x += Ops::kWidth) {
+            written |= RasterizePixels<Ops, kOutput>(w_row, a,
+                                            static_cast<float>(x - org_x),
+                                            sign, face_id, depth_test, x, y,
+                                            target);
+          }
+          for (; x <= bx1; x++) {
+            written |= RasterizePixels<ScalarOps, kOutput>(
+                w_row, a, static_cast<float>(x - org_x), sign, face_id,
+                depth_test, x, y, target);
+          }
+        }
+
+        if (use_depth && written) {
+          DepthRange<Ops>(target, bx, by,
+                          RasterMin(bx + kRasterBlockWidth - 1, tile_x1),
+                          RasterMin(by + kRasterBlockHeight - 1, tile_y1),
+                          &block_z_min[block], &block_z_max[block]);
+          tile_updated = true;
+        }
+      }
+    }
+
+    if (tile_updated) {
+      tile_z_max = 0.0f;
+      for (int block = 0; block < block_rows * block_cols; block++) {
+        tile_z_max = RasterMax(tile_z_max, block_z_max[block]);
+      }
+    }
+  }
+}
+
+// Instance of tile kernel for output
+template <typename Ops>
+RasterKernel SelectRasterKernel(RasterOutput output) {
+  switch (output) {
+    case RasterOutput::kCoverage:
+      return &RasterizeTile<Ops, RasterOutput::kCoverage>;
+    case RasterOutput::kDepth:
+      return &RasterizeTile<Ops, RasterOutput::kDepth>;
+    case RasterOutput::kFaceId:
+      return &RasterizeTile<Ops, RasterOutput::kFaceId>;
+    case RasterOutput::kFull:
+      return &RasterizeTile<Ops, RasterOutput::kFull>;
+  }
+  return nullptr;
+}
+
+}  // namespace
+}  // namespace currender
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+// Compiled with SSE4.1 flag (e.g. -msse4.1)
+
+#include "src/raster_kernel.h"
+#include "src/shade_kernel.h"
+
+// Visual Studio does not need any flag for SSE4.1 intrinsics
+#if defined(__SSE4_1__) || \
+    (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+#define CURRENDER_RASTER_SSE41
+#endif
+
+#ifdef CURRENDER_RASTER_SSE41
+
+#include <smmintrin.h>
+
+#include "src/raster_kernel_impl.h"
+#include "src/shade_kernel_impl.h"
+
+namespace currender {
+namespace {
+
+struct Sse41Ops {
+  static const int kWidth = 4;
+  typedef __m128 F;
+  typedef __m128i I;
+  typedef __m128 M;
+
+  static F Set1(float v) { return _mm_set1_ps(v); }
+  static F Iota() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+  static F Add(F a, F b) { return _mm_add_ps(a, b); }
+  static F Sub(F a, F b) { return _mm_sub_ps(a, b); }
+  static F Mul(F a, F b) { return _mm_mul_ps(a, b); }
+  static F Div(F a, F b) { return _mm_div_ps(a, b); }
+  static F Sqrt(F a) { return _mm_sqrt_ps(a); }
+  static F Abs(F a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+  static F Min(F a, F b) { return _mm_min_ps(a, b); }
+  static F Max(F a, F b) { return _mm_max_ps(a, b); }
+  static float ReduceMin(F a) {
+    a = _mm_min_ps(a, _mm_movehl_ps(a, a));
+    a = _mm_min_ss(a, _mm_shuffle_ps(a, a, 1));
+    return _mm_cvtss_f32(a);
+  }
+  static float ReduceMax(F a) {
+    a = _mm_max_ps(a, _mm_movehl_ps(a, a));
+    a = _mm_max_ss(a, _mm_shuffle_ps(a, a, 1));
+    return _mm_cvtss_f32(a);
+  }
+  static M CmpGe(F a, F b) { return _mm_cmpge_ps(a, b); }
+  static M CmpLt(F a, F b) { return _mm_cmplt_ps(a, b); }
+  static M And(M a, M b) { return _mm_and_ps(a, b); }
+  static M Or(M a, M b) { return _mm_or_ps(a, b); }
+  static bool Any(M m) { return _mm_movemask_ps(m) != 0; }
+  static F Load(const float* p) { return _mm_loadu_ps(p); }
+  static void Store(float* p, F v) { _mm_storeu_ps(p, v); }
+  static F Select(M m, F a, F b) { return _mm_blendv_ps(b, a, m); }
+  static I Set1I(int v) { return _mm_set1_epi32(v); }
+  static I LoadI(const int* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  }
+  static void StoreI(int* p, I v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+  }
+  static I SelectI(M m, I a, I b) {
+    return _mm_castps_si128(
+        _mm_blendv_ps(_mm_castsi128_ps(b), _mm_castsi128_ps(a), m));
+  }
+};
+
+}  // namespace
+
+RasterKernel GetRasterKernelSse41(RasterOutput output) {
+  return SelectRasterKernel<Sse41Ops>(output);
+}
+
+ShadeKernel GetShadeKernelSse41(ShadeModel model) {
+  return SelectShadeKernel<Sse41Ops>(model);
+}
+
+}  // namespace currender
+
+#else
+
+namespace currender {
+
+RasterKernel GetRasterKernelSse41(RasterOutput) { return nullptr; }
+
+ShadeKernel GetShadeKernelSse41(ShadeModel) { return nullptr; }
+
+}  // namespace currender
+
+#endif
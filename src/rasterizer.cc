@@ -6,27 +6,394 @@
 #include "currender/rasterizer.h"
 
 #include <cassert>
+#include <cstring>
 
+#include "src/mipmap.h"
 #include "src/pixel_shader.h"
+#include "src/raster_kernel.h"
+#include "src/ray_table.h"
 #include "src/util_private.h"
 
 #include "ugu/timer.h"
 
 namespace {
 
-template <typename T>
-void Argsort(const std::vector<T>& data, std::vector<size_t>* indices) {
-  indices->resize(data.size());
-  std::iota(indices->begin(), indices->end(), 0);
-  std::sort(indices->begin(), indices->end(),
-            [&data](size_t i1, size_t i2) { return data[i1] < data[i2]; });
-}
-
 inline float EdgeFunction(const Eigen::Vector3f& a, const Eigen::Vector3f& b,
                           const Eigen::Vector3f& c) {
   return (c[0] - a[0]) * (b[1] - a[1]) - (c[1] - a[1]) * (b[0] - a[0]);
 }
 
+// Screen is divided into square tiles. Each tile is rasterized independently
+// by one thread, so no synchronization is needed for the z-buffer
+const int kTileSize = 32;
+
+// Per-triangle values computed once before rasterization, stored as
+// structure of arrays.
+// Edge function k (opposite to vertex k) is pre-multiplied by 1/area and 1/z
+// of vertex k, and its constant term is taken at the bounding box origin
+// (x0, y0). Then for a pixel (x, y)
+//   w_k = a_k * (x - x0) + b_k * (y - y0) + c_k
+// is non-negative for all k inside of the triangle, depth is
+// 1 / (w_0 + w_1 + w_2) and perspective-correct barycentric is w_k * depth.
+struct TriangleSetup {
+  std::vector<float> a[3];
+  std::vector<float> b[3];
+  std::vector<float> c[3];
+  std::vector<int> x0, y0, x1, y1;  // clipped bounding box in pixel
+  std::vector<float> z_min, z_max;  // depth range of vertices
+  std::vector<int> face_id;
+  std::vector<unsigned char> backface;  // 255: backface, 0:frontface
+
+  int size() const { return static_cast<int>(face_id.size()); }
+  currender::RasterTriangles View() const {
+    currender::RasterTriangles view;
+    for (int k = 0; k < 3; k++) {
+      view.a[k] = a[k].data();
+      view.b[k] = b[k].data();
+      view.c[k] = c[k].data();
+    }
+    view.x0 = x0.data();
+    view.y0 = y0.data();
+    view.x1 = x1.data();
+    view.y1 = y1.data();
+    view.z_min = z_min.data();
+    view.z_max = z_max.data();
+    view.face_id = face_id.data();
+    view.backface = backface.data();
+    return view;
+  }
+  void Clear() {
+    for (int k = 0; k < 3; k++) {
+      a[k].clear();
+      b[k].clear();
+      c[k].clear();
+    }
+    x0.clear();
+    y0.clear();
+    x1.clear();
+    y1.clear();
+    z_min.clear();
+    z_max.clear();
+    face_id.clear();
+    backface.clear();
+  }
+};
+
+// Rays through pixels in camera coordinate scaled to z = 1
+// For perspective cameras ray(x, y) = org + x * dx + y * dy
+struct PixelRays {
+  Eigen::Vector3f org;
+  Eigen::Vector3f dx;
+  Eigen::Vector3f dy;
+};
+
+PixelRays MakePixelRays(const currender::Camera& camera) {
+  PixelRays rays;
+  Eigen::Vector3f x1, y1;
+  camera.Unproject(Eigen::Vector3f(0.0f, 0.0f, 1.0f), &rays.org);
+  camera.Unproject(Eigen::Vector3f(1.0f, 0.0f, 1.0f), &x1);
+  camera.Unproject(Eigen::Vector3f(0.0f, 1.0f, 1.0f), &y1);
+  rays.dx = x1 - rays.org;
+  rays.dy = y1 - rays.org;
+  return rays;
+}
+
+// Clips convex polygon by plane z = clip_z (Sutherland-Hodgman)
+// Keeps z >= clip_z if keep_far is true, otherwise z <= clip_z
+// Returns the number of vertices written to dst
+int ClipPolygon(const Eigen::Vector3f* src, int src_num, float clip_z,
+                bool keep_far, Eigen::Vector3f* dst) {
+  const float sign = keep_far ? 1.0f : -1.0f;
+  int dst_num = 0;
+  for (int i = 0; i < src_num; i++) {
+    const Eigen::Vector3f& cur = src[i];
+    const Eigen::Vector3f& next = src[(i + 1) % src_num];
+    const float d_cur = (cur.z() - clip_z) * sign;
+    const float d_next = (next.z() - clip_z) * sign;
+    if (d_cur >= 0.0f) {
+      dst[dst_num++] = cur;
+    }
+    if ((d_cur >= 0.0f) != (d_next >= 0.0f)) {
+      dst[dst_num] = cur + (d_cur / (d_cur - d_next)) * (next - cur);
+      dst[dst_num].z() = clip_z;
+      dst_num++;
+    }
+  }
+  return dst_num;
+}
+
+// Computes TriangleSetup for faces in face_list which may be visible on screen
+// Triangles crossing near or far plane are set up in camera coordinate with
+// homogeneous barycentric, and their pixels out of [near_z, far_z] are clipped
+// by depth in rasterization kernel
+// faces may be reordered from the mesh. face_order maps them to the original
+// index used for face normal and output face id (identity if empty)
+void SetupTriangles(const std::vector<Eigen::Vector3i>& faces,
+                    const std::vector<Eigen::Vector3f>& face_normals,
+                    const std::vector<int>& face_order,
+                    const std::vector<int>& face_list,
+                    const std::vector<Eigen::Vector3f>& camera_vertices,
+                    const std::vector<Eigen::Vector3f>& image_vertices,
+                    const Eigen::Matrix3f& w2c_R,
+                    const currender::Camera& camera, float near_z, float far_z,
+                    TriangleSetup* setup) {
+  setup->Clear();
+  const int width = camera.width();
+  const int height = camera.height();
+  const PixelRays rays = MakePixelRays(camera);
+  for (int i : face_list) {
+    const Eigen::Vector3i& face = faces[i];
+    const int org_i = face_order.empty() ? i : face_order[i];
+    const Eigen::Vector3f* vc[3] = {&camera_vertices[face[0]],
+                                   &camera_vertices[face[1]],
+                                   &camera_vertices[face[2]]};
+    const Eigen::Vector3f* v[3] = {&image_vertices[face[0]],
+                                   &image_vertices[face[1]],
+                                   &image_vertices[face[2]]};
+
+    int num_near = 0;
+    int num_far = 0;
+    for (int k = 0; k < 3; k++) {
+      num_near += vc[k]->z() < near_z ? 1 : 0;
+      num_far += vc[k]->z() > far_z ? 1 : 0;
+    }
+    // the whole triangle is out of near or far plane
+    if (num_near == 3 || num_far == 3) {
+      continue;
+    }
+    const bool crossing = num_near > 0 || num_far > 0;
+
+    float xmin, ymin, xmax, ymax, zmin, zmax;
+    if (!crossing) {
+      xmin = std::min({v[0]->x(), v[1]->x(), v[2]->x()});
+      ymin = std::min({v[0]->y(), v[1]->y(), v[2]->y()});
+      xmax = std::max({v[0]->x(), v[1]->x(), v[2]->x()});
+      ymax = std::max({v[0]->y(), v[1]->y(), v[2]->y()});
+      zmin = std::min({v[0]->z(), v[1]->z(), v[2]->z()});
+      zmax = std::max({v[0]->z(), v[1]->z(), v[2]->z()});
+    } else {
+      // bounding box of projected polygon clipped by near and far plane
+      const Eigen::Vector3f triangle[3] = {*vc[0], *vc[1], *vc[2]};
+      Eigen::Vector3f near_clipped[4];
+      Eigen::Vector3f polygon[5];
+      int polygon_num = ClipPolygon(triangle, 3, near_z, true, near_clipped);
+      polygon_num =
+          ClipPolygon(near_clipped, polygon_num, far_z, false, polygon);
+      if (polygon_num < 3) {
+        continue;
+      }
+      xmin = ymin = zmin = std::numeric_limits<float>::max();
+      xmax = ymax = zmax = std::numeric_limits<float>::lowest();
+      for (int k = 0; k < polygon_num; k++) {
+        Eigen::Vector3f image_p;
+        camera.Project(polygon[k], &image_p);
+        xmin = std::min(xmin, image_p.x());
+        ymin = std::min(ymin, image_p.y());
+        xmax = std::max(xmax, image_p.x());
+        ymax = std::max(ymax, image_p.y());
+        zmin = std::min(zmin, polygon[k].z());
+        zmax = std::max(zmax, polygon[k].z());
+      }
+    }
+
+    // the triangle is out of screen
+    if (xmin > width - 1 || xmax < 0 || ymin > height - 1 || ymax < 0) {
+      continue;
+    }
+
+    // even if back-face culling is enabled, dont' skip back-face
+    // need to update z-buffer to handle front-face occluded by back-face
+    // the sign of dot product between face normal and ray is the same for
+    // all rays hitting a plane, so the ray to a vertex represents them
+    bool backface = false;
+    if (!face_normals.empty()) {
+      backface =
+          (w2c_R * face_normals[org_i]).dot(camera_vertices[face[0]]) > 0;
+    }
+
+    // area on image for triangles in front of camera, otherwise signed volume
+    // of tetrahedron made by the triangle and camera center
+    // front-face must be counter-clockwise on image and back-face must be
+    // clockwise. otherwise no pixel is inside
+    float area = 0.0f;
+    float volume = 0.0f;
+    if (!crossing) {
+      area = EdgeFunction(*v[0], *v[1], *v[2]);
+      if (std::abs(area) < std::numeric_limits<float>::min()) {
+        continue;
+      }
+      if (backface == (area > 0.0f)) {
+        continue;
+      }
+    } else {
+      volume = vc[0]->dot(vc[1]->cross(*vc[2]));
+      if (std::abs(volume) < std::numeric_limits<float>::min()) {
+        continue;
+      }
+      if (backface != (volume > 0.0f)) {
+        continue;
+      }
+    }
+
+    int x0 = std::max(int32_t(0), (int32_t)(std::ceil(xmin)));
+    int x1 = std::min(width - 1, (int32_t)(std::floor(xmax)));
+    int y0 = std::max(int32_t(0), (int32_t)(std::ceil(ymin)));
+    int y1 = std::min(height - 1, (int32_t)(std::floor(ymax)));
+
+    // no pixel center is inside of bounding box
+    if (x1 < x0 || y1 < y0) {
+      continue;
+    }
+
+    if (!crossing) {
+      Eigen::Vector3f origin(static_cast<float>(x0), static_cast<float>(y0),
+                             0.0f);
+      for (int k = 0; k < 3; k++) {
+        const Eigen::Vector3f& p = *v[(k + 1) % 3];
+        const Eigen::Vector3f& q = *v[(k + 2) % 3];
+        const float scale = 1.0f / (area * v[k]->z());
+        setup->a[k].push_back((q.y() - p.y()) * scale);
+        setup->b[k].push_back((p.x() - q.x()) * scale);
+        setup->c[k].push_back(EdgeFunction(p, q, origin) * scale);
+      }
+    } else {
+      // for ray r of a pixel, w_k = r.dot(p_k+1 x p_k+2) / volume whose sum
+      // is 1 / z. valid even if vertices are behind camera
+      const Eigen::Vector3f origin = rays.org +
+                                     static_cast<float>(x0) * rays.dx +
+                                     static_cast<float>(y0) * rays.dy;
+      for (int k = 0; k < 3; k++) {
+        const Eigen::Vector3f e =
+            vc[(k + 1) % 3]->cross(*vc[(k + 2) % 3]) / volume;
+        setup->a[k].push_back(rays.dx.dot(e));
+        setup->b[k].push_back(rays.dy.dot(e));
+        setup->c[k].push_back(origin.dot(e));
+      }
+    }
+    setup->x0.push_back(x0);
+    setup->y0.push_back(y0);
+    setup->x1.push_back(x1);
+    setup->y1.push_back(y1);
+    setup->z_min.push_back(zmin);
+    setup->z_max.push_back(zmax);
+    setup->face_id.push_back(org_i);
+    setup->backface.push_back(backface ? 255 : 0);
+  }
+}
+
+// Spatially close faces are grouped into chunks with bounding box so that
+// faces out of view frustum are skipped by chunk before per-triangle work
+struct MeshChunk {
+  Eigen::Vector3f bb_min;
+  Eigen::Vector3f bb_max;
+};
+
+const int kChunkSize = 256;
+
+// Groups faces sorted along Morton order of their centroids into chunks
+void BuildChunks(const std::vector<Eigen::Vector3f>& vertices,
+                 const std::vector<Eigen::Vector3i>& faces,
+                 std::vector<MeshChunk>* chunks, std::vector<int>* face_chunk) {
+  const int face_num = static_cast<int>(faces.size());
+  chunks->clear();
+  face_chunk->assign(face_num, 0);
+  if (face_num < 1) {
+    return;
+  }
+
+  std::vector<int> face_order;
+  currender::MortonFaceOrder(vertices, faces, &face_order);
+
+  chunks->resize((face_num + kChunkSize - 1) / kChunkSize);
+  for (int j = 0; j < face_num; j++) {
+    const int i = face_order[j];
+    MeshChunk& chunk = (*chunks)[j / kChunkSize];
+    if (j % kChunkSize == 0) {
+      chunk.bb_min = vertices[faces[i][0]];
+      chunk.bb_max = vertices[faces[i][0]];
+    }
+    for (int k = 0; k < 3; k++) {
+      chunk.bb_min = chunk.bb_min.cwiseMin(vertices[faces[i][k]]);
+      chunk.bb_max = chunk.bb_max.cwiseMax(vertices[faces[i][k]]);
+    }
+    (*face_chunk)[i] = j / kChunkSize;
+  }
+}
+
+// Six planes of view frustum in world coordinate
+// Point p is inside if plane.head<3>().dot(p) + plane[3] >= 0 for all planes
+void MakeFrustum(const currender::Camera& camera, float near_z, float far_z,
+                 Eigen::Vector4f planes[6]) {
+  const Eigen::Affine3f c2w = camera.c2w().cast<float>();
+  const Eigen::Affine3f w2c = camera.w2c().cast<float>();
+
+  // side planes pass through edges of image at two depths. pixel centers
+  // are integer so the image covers [-0.5, size - 0.5]
+  const float x_min = -0.5f;
+  const float y_min = -0.5f;
+  const float x_max = camera.width() - 0.5f;
+  const float y_max = camera.height() - 0.5f;
+  const Eigen::Vector3f corners[4] = {
+      Eigen::Vector3f(x_min, y_min, 1.0f), Eigen::Vector3f(x_max, y_min, 1.0f),
+      Eigen::Vector3f(x_max, y_max, 1.0f), Eigen::Vector3f(x_min, y_max, 1.0f)};
+  Eigen::Vector3f inside;
+  camera.Unproject(Eigen::Vector3f(camera.width() * 0.5f,
+                                   camera.height() * 0.5f, 1.0f),
+                   &inside);
+  inside = c2w * inside;
+  for (int k = 0; k < 4; k++) {
+    Eigen::Vector3f a, b, c;
+    camera.Unproject(corners[k], &a);
+    camera.Unproject(corners[(k + 1) % 4], &b);
+    camera.Unproject(Eigen::Vector3f(corners[k].x(), corners[k].y(), 2.0f),
+                     &c);
+    a = c2w * a;
+    b = c2w * b;
+    c = c2w * c;
+    Eigen::Vector3f n = (b - a).cross(c - a);
+    if (n.dot(inside - a) < 0.0f) {
+      n = -n;
+    }
+    planes[k] << n, -n.dot(a);
+  }
+
+  // z in camera coordinate is the 3rd row of w2c
+  const Eigen::Vector3f z_axis = w2c.linear().row(2).transpose();
+  const float z_offset = w2c.translation().z();
+  planes[4] << z_axis, z_offset - near_z;
+  planes[5] << -z_axis, far_z - z_offset;
+}
+
+bool IsOutside(const Eigen::Vector4f planes[6], const Eigen::Vector3f& bb_min,
+               const Eigen::Vector3f& bb_max) {
+  for (int k = 0; k < 6; k++) {
+    // the farthest corner to the inside direction
+    Eigen::Vector3f p;
+    for (int j = 0; j < 3; j++) {
+      p[j] = planes[k][j] < 0.0f ? bb_min[j] : bb_max[j];
+    }
+    if (planes[k].head<3>().dot(p) + planes[k][3] < 0.0f) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Intermediate buffers kept by renderer and reused over rendering to avoid
+// heap allocation. Reallocated only when camera resolution or mesh changes
+struct RasterArena {
+  currender::Image1f depth;      // used if depth is not requested
+  currender::Image1i face_id;    // used if face id is not requested
+  currender::Image1f weight[3];  // perspective-correct barycentric
+  currender::Image1f depth_w;    // float depth for Image1w interfaces
+  std::vector<unsigned char> chunk_visible;
+  std::vector<int> face_list;
+  TriangleSetup setup;
+  std::vector<std::vector<int>> bins;
+  std::vector<currender::RasterStats> tile_stats;
+  currender::ShadingContext shading_context;  // reset for color
+};
+
 }  // namespace
 
 namespace currender {
@@ -37,6 +404,46 @@ class Rasterizer::Impl {
   std::shared_ptr<const Camera> camera_{nullptr};
   std::shared_ptr<const Mesh> mesh_{nullptr};
   RendererOption option_;
+  std::unique_ptr<PixelShader> pixel_shader_;
+  mutable RasterizerStats stats_;
+  mutable RasterArena arena_;
+  mutable bool weight_valid_{false};  // arena_.weight of the last Render()
+
+  // faces and vertices reordered for memory locality if
+  // RendererOption::reorder_mesh is set. face_order_ maps reordered face index
+  // to the original one. all are empty if not reordered
+  std::vector<Eigen::Vector3f> reordered_vertices_;
+  std::vector<Eigen::Vector3i> reordered_faces_;
+  std::vector<int> face_order_;
+  const std::vector<Eigen::Vector3f>& vertices() const {
+    return face_order_.empty() ? mesh_->vertices() : reordered_vertices_;
+  }
+  const std::vector<Eigen::Vector3i>& faces() const {
+    return face_order_.empty() ? mesh_->vertex_indices() : reordered_faces_;
+  }
+
+  // tiled textures and their mipmaps for DiffuseColor::kTexture
+  std::vector<Mipmap> mipmaps_;
+
+  std::vector<MeshChunk> chunks_;
+  std::vector<int> face_chunk_;  // chunk index of each face
+
+  // vertices in camera and image coordinate
+  // reused while mesh, camera pose and intrinsics are unchanged
+  mutable std::vector<Eigen::Vector3f> camera_vertices_;
+  mutable std::vector<Eigen::Vector3f> image_vertices_;
+  mutable bool vertex_cache_valid_{false};
+  mutable Eigen::Matrix4d cached_w2c_;
+  mutable Eigen::Vector4f cached_intrinsics_;  // fx, fy, cx, cy
+  mutable int cached_width_{-1};
+  mutable int cached_height_{-1};
+
+  // view rays for shading reused while intrinsics are unchanged
+  mutable RayTable ray_table_;
+
+  void TransformVertices() const;
+  void Resolve(Image1f* depth, Image1i* face_id, const Image1f* weight_image,
+               Image3b* color, Image3f* normal, Image1b* mask) const;
 
  public:
   Impl();
@@ -63,20 +470,33 @@ class Rasterizer::Impl {
   bool RenderW(Image3b* color, Image1w* depth, Image3f* normal, Image1b* mask,
                Image1i* face_id) const;
   bool RenderDepthW(Image1w* depth) const;
+
+  const RasterizerStats& stats() const;
+  const Image1f* barycentric() const;
 };
 
-Rasterizer::Impl::Impl() {}
+Rasterizer::Impl::Impl() { set_option(RendererOption()); }
 Rasterizer::Impl::~Impl() {}
 
 Rasterizer::Impl::Impl(const RendererOption& option) { set_option(option); }
 
 void Rasterizer::Impl::set_option(const RendererOption& option) {
   option.CopyTo(&option_);
+
+  // make pixel shader
+  pixel_shader_ = PixelShaderFactory::Create(
+      option_.diffuse_color, option_.interp, option_.diffuse_shading);
 }
 
 void Rasterizer::Impl::set_mesh(std::shared_ptr<const Mesh> mesh) {
   mesh_initialized_ = false;
+  vertex_cache_valid_ = false;
   mesh_ = mesh;
+  reordered_vertices_.clear();
+  reordered_faces_.clear();
+  face_order_.clear();
+  // texture of new mesh may be at freed address of old one
+  mipmaps_.clear();
 
   if (mesh_->face_normals().empty()) {
     LOGW("face normal is empty. culling and shading may not work\n");
@@ -93,6 +513,24 @@ bool Rasterizer::Impl::PrepareMesh() {
     return false;
   }
 
+  if (option_.reorder_mesh) {
+    Timer<> timer;
+    timer.Start();
+    ReorderMesh(mesh_->vertices(), mesh_->vertex_indices(),
+                &reordered_vertices_, &reordered_faces_, &face_order_);
+    timer.End();
+    LOGI("  Mesh reordering time: %.1f msecs\n", timer.elapsed_msec());
+  } else {
+    reordered_vertices_.clear();
+    reordered_faces_.clear();
+    face_order_.clear();
+  }
+
+  BuildChunks(vertices(), faces(), &chunks_, &face_chunk_);
+  vertex_cache_valid_ = false;
+
+  PrepareMipmaps(*mesh_, option_, &mipmaps_);
+
   mesh_initialized_ = true;
 
   return true;
@@ -102,203 +540,325 @@ void Rasterizer::Impl::set_camera(std::shared_ptr<const Camera> camera) {
   camera_ = camera;
 }
 
-bool Rasterizer::Impl::Render(Image3b* color, Image1f* depth, Image3f* normal,
-                              Image1b* mask, Image1i* face_id) const {
-  if (!ValidateAndInitBeforeRender(mesh_initialized_, camera_, mesh_, option_,
-                                   color, depth, normal, mask, face_id)) {
-    return false;
+void Rasterizer::Impl::TransformVertices() const {
+  // camera may be modified outside after set_camera(), so compare values.
+  // intrinsics are known only for pinhole camera and others are never cached
+  const PinholeCamera* pinhole =
+      dynamic_cast<const PinholeCamera*>(camera_.get());
+  Eigen::Vector4f intrinsics = Eigen::Vector4f::Zero();
+  if (pinhole != nullptr) {
+    intrinsics << pinhole->focal_length(), pinhole->principal_point();
+  }
+  if (vertex_cache_valid_ && pinhole != nullptr &&
+      cached_w2c_ == camera_->w2c().matrix() &&
+      cached_intrinsics_ == intrinsics &&
+      cached_width_ == camera_->width() &&
+      cached_height_ == camera_->height()) {
+    return;
   }
-
-  // make pixel shader
-  std::unique_ptr<PixelShader> pixel_shader = PixelShaderFactory::Create(
-      option_.diffuse_color, option_.interp, option_.diffuse_shading);
-
-  OrenNayarParam oren_nayar_param(option_.oren_nayar_sigma);
 
   const Eigen::Matrix3f w2c_R = camera_->w2c().rotation().cast<float>();
   const Eigen::Vector3f w2c_t = camera_->w2c().translation().cast<float>();
-
-  Timer<> timer;
-  timer.Start();
-
-  // project face to 2d (fully parallel)
-  std::vector<Eigen::Vector3f> camera_vertices(mesh_->vertices().size());
-  std::vector<Eigen::Vector3f> camera_normals(mesh_->vertices().size());
-  std::vector<float> camera_depth_list(mesh_->vertices().size());
-  std::vector<Eigen::Vector3f> image_vertices(mesh_->vertices().size());
-
-  // get projected vertex positions
-  for (int i = 0; i < static_cast<int>(mesh_->vertices().size()); i++) {
-    camera_vertices[i] = w2c_R * mesh_->vertices()[i] + w2c_t;
-    camera_normals[i] = w2c_R * mesh_->normals()[i];
-    camera_depth_list[i] = camera_vertices[i].z();
-    camera_->Project(camera_vertices[i], &image_vertices[i]);
+  const std::vector<Eigen::Vector3f>& vertices = this->vertices();
+  const int vertex_num = static_cast<int>(vertices.size());
+  camera_vertices_.resize(vertex_num);
+  image_vertices_.resize(vertex_num);
+
+  // only positions are needed for rasterization
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(static)
+#endif
+  for (int i = 0; i < vertex_num; i++) {
+    camera_vertices_[i] = w2c_R * vertices[i] + w2c_t;
+    camera_->Project(camera_vertices_[i], &image_vertices_[i]);
   }
 
-  Image1f depth_internal;
-  Image1f* depth_{depth};
-  if (depth_ == nullptr) {
-    depth_ = &depth_internal;
-  }
-  Init(depth_, camera_->width(), camera_->height(), 0.0f);
+  vertex_cache_valid_ = true;
+  cached_w2c_ = camera_->w2c().matrix();
+  cached_intrinsics_ = intrinsics;
+  cached_width_ = camera_->width();
+  cached_height_ = camera_->height();
+}
 
-  Image1i face_id_internal;
-  Image1i* face_id_{face_id};
-  if (face_id_ == nullptr) {
-    face_id_ = &face_id_internal;
+// Deferred resolve of visibility buffer (depth, face id and barycentric)
+// Pixels are independent so rows are processed in parallel. Empty pixels are
+// skipped and only requested outputs are computed
+// face_id and weight_image may be nullptr if neither color nor normal is
+// requested
+void Rasterizer::Impl::Resolve(Image1f* depth, Image1i* face_id,
+                               const Image1f* weight_image, Image3b* color,
+                               Image3f* normal, Image1b* mask) const {
+  const bool need_uv_derivatives =
+      option_.diffuse_color == DiffuseColor::kTexture &&
+      option_.interp == ColorInterpolation::kTrilinear;
+  const bool need_shading_normal =
+      normal != nullptr ||
+      (color != nullptr && option_.diffuse_shading != DiffuseShading::kNone);
+  const Eigen::Matrix3f w2c_R = camera_->w2c().rotation().cast<float>();
+  const auto& face_normals = mesh_->face_normals();
+  const auto& normals = mesh_->normals();
+  const auto& normal_indices = mesh_->normal_indices();
+  const ShadingContext* context = nullptr;
+  if (color != nullptr) {
+    ray_table_.Update(*camera_);
+    arena_.shading_context.Reset(*mesh_, option_, &mipmaps_);
+    context = &arena_.shading_context;
   }
-  Init(face_id_, camera_->width(), camera_->height(), -1);
-
-  // 255: backface, 0:frontface
-  Image1b backface_image;
-  Init(&backface_image, camera_->width(), camera_->height(),
-       static_cast<unsigned char>(0));
-
-  // 0:(1 - u - v), 1:u, 2:v
-  Image3f weight_image;
-  Init(&weight_image, camera_->width(), camera_->height(), 0.0f);
-
-  // make face id image by z-buffer method
-  for (int i = 0; i < static_cast<int>(mesh_->vertex_indices().size()); i++) {
-    const Eigen::Vector3i& face = mesh_->vertex_indices()[i];
-    const Eigen::Vector3f& v0_i = image_vertices[face[0]];
-    const Eigen::Vector3f& v1_i = image_vertices[face[1]];
-    const Eigen::Vector3f& v2_i = image_vertices[face[2]];
-
-    // skip if a vertex is back of the camera
-    // todo: add near and far plane
-    if (v0_i.z() < 0.0f || v1_i.z() < 0.0f || v2_i.z() < 0.0f) {
-      continue;
-    }
 
-    float xmin = std::min({v0_i.x(), v1_i.x(), v2_i.x()});
-    float ymin = std::min({v0_i.y(), v1_i.y(), v2_i.y()});
-    float xmax = std::max({v0_i.x(), v1_i.x(), v2_i.x()});
-    float ymax = std::max({v0_i.y(), v1_i.y(), v2_i.y()});
-
-    // the triangle is out of screen
-    if (xmin > camera_->width() - 1 || xmax < 0 ||
-        ymin > camera_->height() - 1 || ymax < 0) {
-      continue;
-    }
-
-    uint32_t x0 = std::max(int32_t(0), (int32_t)(std::ceil(xmin)));
-    uint32_t x1 = std::min(camera_->width() - 1, (int32_t)(std::floor(xmax)));
-    uint32_t y0 = std::max(int32_t(0), (int32_t)(std::ceil(ymin)));
-    uint32_t y1 = std::min(camera_->height() - 1, (int32_t)(std::floor(ymax)));
-
-    float area = EdgeFunction(v0_i, v1_i, v2_i);
-    if (std::abs(area) < std::numeric_limits<float>::min()) {
-      continue;
-    }
-    for (uint32_t y = y0; y <= y1; ++y) {
-      for (uint32_t x = x0; x <= x1; ++x) {
-        Eigen::Vector3f ray_w;
-        camera_->ray_w(static_cast<int>(x), static_cast<int>(y), &ray_w);
-        // even if back-face culling is enabled, dont' skip back-face
-        // need to update z-buffer to handle front-face occluded by back-face
-        bool backface = mesh_->face_normals()[i].dot(ray_w) > 0;
-        Eigen::Vector3f pixel_sample(static_cast<float>(x),
-                                     static_cast<float>(y), 0.0f);
-        float w0 = EdgeFunction(v1_i, v2_i, pixel_sample);
-        float w1 = EdgeFunction(v2_i, v0_i, pixel_sample);
-        float w2 = EdgeFunction(v0_i, v1_i, pixel_sample);
-        if ((!backface && (w0 >= 0 && w1 >= 0 && w2 >= 0)) ||
-            (backface && (w0 <= 0 && w1 <= 0 && w2 <= 0))) {
-          w0 /= area;
-          w1 /= area;
-          w2 /= area;
-#if 0
-         // original
-          pixel_sample.z() = w0 * v0_i.z() + w1 * v1_i.z() + w2 * v2_i.z();
-#else
-          /** Perspective-Correct Interpolation **/
-          w0 /= v0_i.z();
-          w1 /= v1_i.z();
-          w2 /= v2_i.z();
-
-          pixel_sample.z() = 1.0f / (w0 + w1 + w2);
-
-          w0 = w0 * pixel_sample.z();
-          w1 = w1 * pixel_sample.z();
-          w2 = w2 * pixel_sample.z();
-          /** Perspective-Correct Interpolation **/
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1)
 #endif
-
-          float& d = depth->at<float>(y, x);
-          if (d < std::numeric_limits<float>::min() || pixel_sample.z() < d) {
-            d = pixel_sample.z();
-            face_id->at<int>(y, x) = i;
-            Vec3f& weight = weight_image.at<Vec3f>(y, x);
-            weight[0] = w0;
-            weight[1] = w1;
-            weight[2] = w2;
-            backface_image.at<unsigned char>(y, x) = backface ? 255 : 0;
-          }
+  for (int y = 0; y < camera_->height(); y++) {
+    // covered pixels of row are shaded in batches
+    ShadingBatch batch;
+    for (int x = 0; x < camera_->width(); x++) {
+      // depth of covered pixel is non-zero in any pipeline
+      float& d = depth->at<float>(y, x);
+      if (d < 0.0f && option_.backface_culling) {
+        d = 0.0f;
+        if (face_id != nullptr) {
+          face_id->at<int>(y, x) = -1;
         }
       }
-    }
-  }
+      d = std::abs(d);
 
-  // make images by referring to face id image
-  for (int y = 0; y < backface_image.rows; y++) {
-    for (int x = 0; x < backface_image.cols; x++) {
-      const unsigned char& bf = backface_image.at<unsigned char>(y, x);
-      int& fid = face_id_->at<int>(y, x);
-      if (option_.backface_culling && bf == 255) {
-        depth_->at<float>(y, x) = 0.0f;
-        fid = -1;
+      // outputs are not initialized before, so clear empty pixels here
+      if (d == 0.0f) {
+        if (color != nullptr) {
+          std::memset(&color->at<Vec3b>(y, x), 0, sizeof(Vec3b));
+        }
+        if (normal != nullptr) {
+          std::memset(&normal->at<Vec3f>(y, x), 0, sizeof(Vec3f));
+        }
+        if (mask != nullptr) {
+          mask->at<unsigned char>(y, x) = 0;
+        }
         continue;
       }
 
-      if (fid > 0) {
-        Eigen::Vector3f ray_w;
-        camera_->ray_w(x, y, &ray_w);
+      // fill mask
+      if (mask != nullptr) {
+        mask->at<unsigned char>(y, x) = 255;
+      }
 
-        Vec3f& weight = weight_image.at<Vec3f>(y, x);
-        float w0 = weight[0];
-        float w1 = weight[1];
-        float w2 = weight[2];
+      if (!need_shading_normal && color == nullptr) {
+        continue;
+      }
 
-        // fill mask
-        if (mask != nullptr) {
-          mask->at<unsigned char>(y, x) = 255;
-        }
+      const int fid = face_id->at<int>(y, x);
+      const float w0 = weight_image[0].at<float>(y, x);
+      const float w1 = weight_image[1].at<float>(y, x);
+      const float w2 = weight_image[2].at<float>(y, x);
 
-        // calculate shading normal
-        Eigen::Vector3f shading_normal_w{0.0f, 0.0f, 0.0f};
+      // calculate shading normal
+      Eigen::Vector3f shading_normal_w{0.0f, 0.0f, 0.0f};
+      if (need_shading_normal) {
         if (option_.shading_normal == ShadingNormal::kFace) {
-          shading_normal_w = mesh_->face_normals()[fid];
+          shading_normal_w = face_normals[fid];
         } else if (option_.shading_normal == ShadingNormal::kVertex) {
           // barycentric interpolation of normal
-          const auto& normals = mesh_->normals();
-          const auto& normal_indices = mesh_->normal_indices();
           shading_normal_w = w0 * normals[normal_indices[fid][0]] +
                              w1 * normals[normal_indices[fid][1]] +
                              w2 * normals[normal_indices[fid][2]];
         }
+      }
 
-        // set shading normal
-        if (normal != nullptr) {
-          Eigen::Vector3f shading_normal_c =
-              w2c_R * shading_normal_w;  // rotate to camera coordinate
-          Vec3f& n = normal->at<Vec3f>(y, x);
-          for (int k = 0; k < 3; k++) {
-            n[k] = shading_normal_c[k];
-          }
+      // set shading normal
+      if (normal != nullptr) {
+        Eigen::Vector3f shading_normal_c =
+            w2c_R * shading_normal_w;  // rotate to camera coordinate
+        Vec3f& n = normal->at<Vec3f>(y, x);
+        for (int k = 0; k < 3; k++) {
+          n[k] = shading_normal_c[k];
         }
+      }
 
-        // delegate color calculation to pixel_shader
-        if (color != nullptr) {
-          Eigen::Vector3f light_dir = ray_w;  // emit light same as ray
-          PixelShaderInput pixel_shader_input(color, x, y, w1, w2, fid, &ray_w,
-                                              &light_dir, &shading_normal_w,
-                                              &oren_nayar_param, mesh_);
-          pixel_shader->Process(pixel_shader_input);
+      // delegate color calculation to pixel_shader
+      if (color != nullptr) {
+        Eigen::Vector3f ray_w;
+        ray_table_.ray_w(x, y, &ray_w);
+        float uv_derivatives[4];
+        if (need_uv_derivatives) {
+          const Eigen::Vector3i& face = context->faces[fid];
+          BarycentricDerivatives(ray_table_, x, y, context->vertices[face[0]],
+                                 context->vertices[face[1]],
+                                 context->vertices[face[2]], uv_derivatives);
         }
+        pixel_shader_->Push(context, x, y, w1, w2, fid, ray_w,
+                            shading_normal_w, &batch, color,
+                            need_uv_derivatives ? uv_derivatives : nullptr);
       }
     }
+    if (color != nullptr) {
+      pixel_shader_->Flush(&batch, color);
+    }
   }
+}
+
+bool Rasterizer::Impl::Render(Image3b* color, Image1f* depth, Image3f* normal,
+                              Image1b* mask, Image1i* face_id) const {
+  weight_valid_ = false;
+  if (!ValidateBeforeRender(mesh_initialized_, camera_, mesh_, option_, color,
+                            depth, normal, mask, face_id)) {
+    return false;
+  }
+  if (color != nullptr && !ValidateMipmaps(*mesh_, option_, mipmaps_)) {
+    return false;
+  }
+
+  const Eigen::Matrix3f w2c_R = camera_->w2c().rotation().cast<float>();
+  const int width = camera_->width();
+  const int height = camera_->height();
+  const int tile_cols = (width + kTileSize - 1) / kTileSize;
+  const int tile_rows = (height + kTileSize - 1) / kTileSize;
+  const int tile_num = tile_cols * tile_rows;
+
+  Timer<> timer;
+  timer.Start();
+
+  TransformVertices();
+
+  // color, normal and mask are fully written by Resolve() and not cleared
+  if (color != nullptr) {
+    Resize(color, width, height);
+  }
+  if (normal != nullptr) {
+    Resize(normal, width, height);
+  }
+  if (mask != nullptr) {
+    Resize(mask, width, height);
+  }
+
+  // pipeline specialized for requested outputs. rasterization maintains only
+  // buffers needed for them. mask needs depth to cull back-face, otherwise
+  // coverage is enough
+  RasterOutput output = RasterOutput::kFull;
+  if (color == nullptr && normal == nullptr) {
+    if (face_id != nullptr) {
+      output = RasterOutput::kFaceId;
+    } else if (depth != nullptr || option_.backface_culling) {
+      output = RasterOutput::kDepth;
+    } else {
+      output = RasterOutput::kCoverage;
+    }
+  }
+
+  // z-buffer is made on output images if requested, otherwise on arena
+  Image1f* depth_{depth};
+  if (depth_ == nullptr) {
+    depth_ = &arena_.depth;
+  }
+  Resize(depth_, width, height);
+  std::fill_n(&depth_->at<float>(0, 0), width * height, 0.0f);
+
+  Image1i* face_id_{face_id};
+  if (face_id_ == nullptr && output >= RasterOutput::kFaceId) {
+    face_id_ = &arena_.face_id;
+  }
+  if (face_id_ != nullptr) {
+    Resize(face_id_, width, height);
+    std::fill_n(&face_id_->at<int>(0, 0), width * height, -1);
+  }
+
+  // weights are read only at covered pixels and need no initialization
+  // 0:(1 - u - v), 1:u, 2:v
+  Image1f* weight_image = nullptr;
+  if (output == RasterOutput::kFull) {
+    weight_image = arena_.weight;
+    for (int k = 0; k < 3; k++) {
+      Resize(&weight_image[k], width, height);
+    }
+  }
+
+  stats_ = RasterizerStats();
+
+  // frustum culling by chunk
+  // face list keeps the original order to get the same result as without it
+  Eigen::Vector4f frustum[6];
+  MakeFrustum(*camera_, option_.near_z, option_.far_z, frustum);
+  std::vector<unsigned char>& chunk_visible = arena_.chunk_visible;
+  chunk_visible.resize(chunks_.size());
+  for (size_t j = 0; j < chunks_.size(); j++) {
+    chunk_visible[j] =
+        IsOutside(frustum, chunks_[j].bb_min, chunks_[j].bb_max) ? 0 : 255;
+    stats_.chunks_culled += chunk_visible[j] == 0 ? 1 : 0;
+  }
+  stats_.chunks = static_cast<int64_t>(chunks_.size());
+  std::vector<int>& face_list = arena_.face_list;
+  face_list.clear();
+  for (int i = 0; i < static_cast<int>(face_chunk_.size()); i++) {
+    if (chunk_visible[face_chunk_[i]] != 0) {
+      face_list.push_back(i);
+    }
+  }
+
+  // triangle setup
+  TriangleSetup& setup = arena_.setup;
+  SetupTriangles(faces(), mesh_->face_normals(), face_order_, face_list,
+                 camera_vertices_, image_vertices_, w2c_R, *camera_,
+                 option_.near_z, option_.far_z, &setup);
+
+  // binning: sort triangles into the tiles their bounding box overlaps
+  // faces are pushed in ascending order so that each tile processes them in
+  // the same order as serial rasterization and gives identical z-buffer
+  std::vector<std::vector<int>>& bins = arena_.bins;
+  bins.resize(tile_num);
+  for (std::vector<int>& bin : bins) {
+    bin.clear();
+  }
+  for (int i = 0; i < setup.size(); i++) {
+    for (int ty = setup.y0[i] / kTileSize; ty <= setup.y1[i] / kTileSize;
+         ty++) {
+      for (int tx = setup.x0[i] / kTileSize; tx <= setup.x1[i] / kTileSize;
+           tx++) {
+        bins[ty * tile_cols + tx].push_back(i);
+      }
+    }
+  }
+
+  // make face id image by z-buffer method
+  // depth of backface is stored as negative value
+  // tiles are independent and each thread writes only pixels of its own tile
+  const RasterKernel kernel = GetRasterKernel(output);
+  const RasterTriangles triangles = setup.View();
+  std::vector<RasterStats>& tile_stats = arena_.tile_stats;
+  tile_stats.resize(tile_num);
+  RasterTarget target;
+  target.depth = &depth_->at<float>(0, 0);
+  target.face_id = face_id_ != nullptr ? &face_id_->at<int>(0, 0) : nullptr;
+  for (int k = 0; k < 3; k++) {
+    target.weight[k] =
+        weight_image != nullptr ? &weight_image[k].at<float>(0, 0) : nullptr;
+  }
+  target.stride = width;
+  target.inv_near = 1.0f / option_.near_z;
+  target.inv_far = 1.0f / option_.far_z;
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (int tile = 0; tile < tile_num; tile++) {
+    const int tile_x0 = (tile % tile_cols) * kTileSize;
+    const int tile_y0 = (tile / tile_cols) * kTileSize;
+    const int tile_x1 = std::min(tile_x0 + kTileSize, width) - 1;
+    const int tile_y1 = std::min(tile_y0 + kTileSize, height) - 1;
+    tile_stats[tile] = RasterStats();
+    kernel(triangles, bins[tile].data(), static_cast<int>(bins[tile].size()),
+           tile_x0, tile_y0, tile_x1, tile_y1, target, &tile_stats[tile]);
+  }
+
+  stats_.triangles = setup.size();
+  for (const RasterStats& s : tile_stats) {
+    stats_.tile_tests += s.tile_tests;
+    stats_.tile_depth_rejected += s.tile_depth_rejected;
+    stats_.block_tests += s.block_tests;
+    stats_.block_edge_rejected += s.block_edge_rejected;
+    stats_.block_depth_rejected += s.block_depth_rejected;
+    stats_.block_depth_accepted += s.block_depth_accepted;
+  }
+
+  // make images by referring to face id image
+  Resolve(depth_, face_id_, weight_image, color, normal, mask);
+  weight_valid_ = weight_image != nullptr;
 
   timer.End();
   LOGI("  Rendering main loop time: %.1f msecs\n", timer.elapsed_msec());
@@ -306,6 +866,12 @@ bool Rasterizer::Impl::Render(Image3b* color, Image1f* depth, Image3f* normal,
   return true;
 }
 
+const RasterizerStats& Rasterizer::Impl::stats() const { return stats_; }
+
+const Image1f* Rasterizer::Impl::barycentric() const {
+  return weight_valid_ ? arena_.weight : nullptr;
+}
+
 bool Rasterizer::Impl::RenderColor(Image3b* color) const {
   return Render(color, nullptr, nullptr, nullptr, nullptr);
 }
@@ -333,7 +899,7 @@ bool Rasterizer::Impl::RenderW(Image3b* color, Image1w* depth, Image3f* normal,
     return false;
   }
 
-  Image1f f_depth;
+  Image1f& f_depth = arena_.depth_w;
   bool org_ret = Render(color, &f_depth, normal, mask, face_id);
 
   if (org_ret) {
@@ -403,4 +969,10 @@ bool Rasterizer::RenderDepthW(Image1w* depth) const {
   return pimpl_->RenderDepthW(depth);
 }
 
+const RasterizerStats& Rasterizer::stats() const { return pimpl_->stats(); }
+
+const Image1f* Rasterizer::barycentric() const {
+  return pimpl_->barycentric();
+}
+
 }  // namespace currender
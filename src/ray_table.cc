@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "src/ray_table.h"
+
+namespace currender {
+
+RayTable::RayTable() {}
+RayTable::~RayTable() {}
+
+bool RayTable::Update(const Camera& camera) {
+  c2w_R_ = camera.c2w().rotation().cast<float>();
+  c2w_t_ = camera.c2w().translation().cast<float>();
+
+  const PinholeCamera* pinhole = dynamic_cast<const PinholeCamera*>(&camera);
+  Eigen::Vector4f intrinsics = Eigen::Vector4f::Zero();
+  if (pinhole != nullptr) {
+    intrinsics << pinhole->focal_length(), pinhole->principal_point();
+  }
+  const bool cached = pinhole_ && pinhole != nullptr &&
+                      intrinsics_ == intrinsics &&
+                      width_ == camera.width() && height_ == camera.height();
+  if (!cached) {
+    width_ = camera.width();
+    height_ = camera.height();
+    pinhole_ = pinhole != nullptr;
+    intrinsics_ = intrinsics;
+
+    const int num_pixels = width_ * height_;
+    ray_c_.resize(num_pixels);
+    org_ray_c_.resize(num_pixels);
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(static)
+#endif
+    for (int y = 0; y < height_; y++) {
+      for (int x = 0; x < width_; x++) {
+        camera.ray_c(x, y, &ray_c_[y * width_ + x]);
+        camera.org_ray_c(x, y, &org_ray_c_[y * width_ + x]);
+      }
+    }
+
+    // origin is usually shared (e.g. pinhole) and transformed once per pose
+    org_ray_c0_ = Eigen::Vector3f::Zero();
+    if (num_pixels > 0) {
+      org_ray_c0_ = org_ray_c_[0];
+    }
+    bool shared_org = true;
+    for (int i = 1; i < num_pixels && shared_org; i++) {
+      shared_org = org_ray_c_[i] == org_ray_c0_;
+    }
+    if (shared_org) {
+      org_ray_c_.clear();
+      org_ray_c_.shrink_to_fit();
+    }
+  }
+
+  org_ray_w0_ = c2w_R_ * org_ray_c0_ + c2w_t_;
+
+  return !cached;
+}
+
+}  // namespace currender
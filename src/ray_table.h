@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "currender/renderer.h"
+
+namespace currender {
+
+// Rays through pixels in camera coordinate, computed once per intrinsics and
+// resolution and reused over camera poses. Only rotation (and translation of
+// origin) is applied per pixel to get rays in world coordinate
+// Drop-in replacement of Camera::ray_w() and Camera::org_ray_w() for integer
+// pixel positions
+class RayTable {
+  std::vector<Eigen::Vector3f> ray_c_;
+  std::vector<Eigen::Vector3f> org_ray_c_;  // empty if shared by all pixels
+  Eigen::Vector3f org_ray_c0_{Eigen::Vector3f::Zero()};
+  int width_{0};
+  int height_{0};
+  bool pinhole_{false};
+  Eigen::Vector4f intrinsics_{Eigen::Vector4f::Zero()};  // fx, fy, cx, cy
+
+  // pose of the last Update()
+  Eigen::Matrix3f c2w_R_{Eigen::Matrix3f::Identity()};
+  Eigen::Vector3f c2w_t_{Eigen::Vector3f::Zero()};
+  Eigen::Vector3f org_ray_w0_{Eigen::Vector3f::Zero()};
+
+ public:
+  RayTable();
+  ~RayTable();
+
+  // Sets pose of camera and recomputes rays in camera coordinate only if
+  // resolution or intrinsics are changed. Camera may be modified outside, so
+  // values are compared. Intrinsics are known only for pinhole camera and
+  // tables of others are recomputed every time
+  // Returns true if recomputed
+  bool Update(const Camera& camera);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  void ray_w(int x, int y, Eigen::Vector3f* dir) const {
+    *dir = c2w_R_ * ray_c_[y * width_ + x];
+  }
+  void org_ray_w(int x, int y, Eigen::Vector3f* org) const {
+    if (org_ray_c_.empty()) {
+      *org = org_ray_w0_;
+    } else {
+      *org = c2w_R_ * org_ray_c_[y * width_ + x] + c2w_t_;
+    }
+  }
+};
+
+}  // namespace currender
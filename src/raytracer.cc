@@ -3,37 +3,54 @@
  * All rights reserved.
  */
 
-#ifdef CURRENDER_USE_NANORT
-
 #include "currender/raytracer.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
 
-#include "nanort.h"
-
+#include "src/bvh.h"
+#include "src/mipmap.h"
 #include "src/pixel_shader.h"
+#include "src/ray_table.h"
 #include "src/util_private.h"
 
 #include "ugu/timer.h"
 
 namespace {
-inline void PrepareRay(nanort::Ray<float>* ray,
-                       const Eigen::Vector3f& camera_pos_w,
-                       const Eigen::Vector3f& ray_w) {
-  const float kFar = 1.0e+30f;
-  ray->min_t = 0.0001f;
-  ray->max_t = kFar;
-
-  // camera position in world coordinate
-  ray->org[0] = camera_pos_w[0];
-  ray->org[1] = camera_pos_w[1];
-  ray->org[2] = camera_pos_w[2];
-
-  // ray in world coordinate
-  ray->dir[0] = ray_w[0];
-  ray->dir[1] = ray_w[1];
-  ray->dir[2] = ray_w[2];
+
+// Primary rays through a square block of pixels are traced together as a
+// packet. Rays from a camera through neighboring pixels are coherent and
+// visit mostly the same BVH nodes, so node visits are shared in the packet
+const int kPacketWidth = 4;
+const int kPacketSize = kPacketWidth * kPacketWidth;
+static_assert(kPacketSize == currender::kRayPacketSize,
+              "packet size must match BVH");
+
+// Square tiles of pixels are scheduled to threads for cache reuse of BVH
+// nodes and mesh
+const int kTileSize = 16;
+
+const float kFar = 1.0e+30f;
+
+// BVH is rebuilt in UpdateMesh() if SAH cost of refitted one exceeds that of
+// built one by this factor
+const float kMaxSahCostGrowth = 1.5f;
+
+inline void SetRay(currender::RayPacket* packet, int j,
+                   const Eigen::Vector3f& org, const Eigen::Vector3f& dir,
+                   float min_t, float max_t) {
+  for (int k = 0; k < 3; k++) {
+    packet->org[k][j] = org[k];
+    packet->dir[k][j] = dir[k];
+  }
+  packet->min_t[j] = min_t;
+  packet->max_t[j] = max_t;
 }
+
 }  // namespace
 
 namespace currender {
@@ -45,15 +62,41 @@ class Raytracer::Impl {
   std::shared_ptr<const Mesh> mesh_{nullptr};
   RendererOption option_;
 
-  std::vector<float> flatten_vertices_;
-  std::vector<unsigned int> flatten_faces_;
-
-  nanort::BVHBuildOptions<float> build_options_;
-  std::unique_ptr<nanort::TriangleMesh<float>> triangle_mesh_;
-  std::unique_ptr<nanort::TriangleSAHPred<float>> triangle_pred_;
-  nanort::BVHAccel<float> accel_;
-  nanort::BVHBuildStatistics stats_;
-  float bmin_[3], bmax_[3];
+  Bvh bvh_;
+  BvhBuildOption bvh_build_option_;
+  float built_sah_cost_{0.0f};
+
+  // tiled textures and their mipmaps for DiffuseColor::kTexture
+  std::vector<Mipmap> mipmaps_;
+
+  // primary rays reused while intrinsics are unchanged
+  mutable RayTable ray_table_;
+
+  // scene of objects used instead of mesh_ if set
+  // bottom-level BVH of each mesh is kept over PrepareMesh() so that only
+  // top-level BVH is rebuilt for moved objects. mesh is held to keep the key
+  // valid
+  struct MeshBvh {
+    std::shared_ptr<const Mesh> mesh;
+    std::unique_ptr<Bvh> bvh;
+    std::vector<Mipmap> mipmaps;
+  };
+  struct SceneObject {
+    std::shared_ptr<const Mesh> mesh;
+    const std::vector<Mipmap>* mipmaps;
+    Eigen::Matrix3f linear;  // object to world
+    Eigen::Vector3f translation;
+    Eigen::Matrix3f normal_o2w;  // inverse transpose of linear
+    bool rigid;  // normals are not scaled
+  };
+  std::shared_ptr<const Scene> scene_{nullptr};
+  std::map<const Mesh*, MeshBvh> mesh_bvhs_;
+  std::vector<SceneObject> scene_objects_;
+  TopLevelBvh top_level_bvh_;
+
+  bool PrepareScene();
+  bool Render(Image3b* color, Image1f* depth, Image3f* normal, Image1b* mask,
+              Image1i* face_id, Image1i* object_id) const;
 
  public:
   Impl();
@@ -63,8 +106,13 @@ class Raytracer::Impl {
   void set_option(const RendererOption& option);
 
   void set_mesh(std::shared_ptr<const Mesh> mesh);
+  void set_scene(std::shared_ptr<const Scene> scene);
 
   bool PrepareMesh();
+  bool UpdateMesh(std::shared_ptr<const Mesh> mesh);
+
+  void set_bvh_build_option(const BvhBuildOption& option);
+  const BvhStats& bvh_stats() const;
 
   void set_camera(std::shared_ptr<const Camera> camera);
 
@@ -76,10 +124,14 @@ class Raytracer::Impl {
   bool RenderNormal(Image3f* normal) const;
   bool RenderMask(Image1b* mask) const;
   bool RenderFaceId(Image1i* face_id) const;
+  bool RenderObjectId(Image1i* object_id) const;
 
   bool RenderW(Image3b* color, Image1w* depth, Image3f* normal, Image1b* mask,
                Image1i* face_id) const;
   bool RenderDepthW(Image1w* depth) const;
+
+  bool IsVisible(const std::vector<Eigen::Vector3f>& points,
+                 std::vector<unsigned char>* visible, float eps) const;
 };
 
 Raytracer::Impl::Impl() {}
@@ -94,6 +146,12 @@ void Raytracer::Impl::set_option(const RendererOption& option) {
 void Raytracer::Impl::set_mesh(std::shared_ptr<const Mesh> mesh) {
   mesh_initialized_ = false;
   mesh_ = mesh;
+  scene_ = nullptr;
+  mesh_bvhs_.clear();
+  scene_objects_.clear();
+  top_level_bvh_.Clear();
+  // texture of new mesh may be at freed address of old one
+  mipmaps_.clear();
 
   if (mesh_->face_normals().empty()) {
     LOGW("face normal is empty. culling and shading may not work\n");
@@ -103,190 +161,430 @@ void Raytracer::Impl::set_mesh(std::shared_ptr<const Mesh> mesh) {
     LOGW("vertex normal is empty. shading may not work\n");
   }
 
-  flatten_vertices_.clear();
-  flatten_faces_.clear();
-
-  const std::vector<Eigen::Vector3f>& vertices = mesh_->vertices();
-  flatten_vertices_.resize(vertices.size() * 3);
-  for (size_t i = 0; i < vertices.size(); i++) {
-    flatten_vertices_[i * 3 + 0] = vertices[i][0];
-    flatten_vertices_[i * 3 + 1] = vertices[i][1];
-    flatten_vertices_[i * 3 + 2] = vertices[i][2];
-  }
+  bvh_.Clear();
+}
 
-  const std::vector<Eigen::Vector3i>& vertex_indices = mesh_->vertex_indices();
-  flatten_faces_.resize(vertex_indices.size() * 3);
-  for (size_t i = 0; i < vertex_indices.size(); i++) {
-    flatten_faces_[i * 3 + 0] = vertex_indices[i][0];
-    flatten_faces_[i * 3 + 1] = vertex_indices[i][1];
-    flatten_faces_[i * 3 + 2] = vertex_indices[i][2];
-  }
+void Raytracer::Impl::set_scene(std::shared_ptr<const Scene> scene) {
+  mesh_initialized_ = false;
+  scene_ = scene;
+  mesh_ = nullptr;
+  bvh_.Clear();
+  mipmaps_.clear();
 }
 
 bool Raytracer::Impl::PrepareMesh() {
+  if (scene_ != nullptr) {
+    mesh_initialized_ = PrepareScene();
+    return mesh_initialized_;
+  }
+
   if (mesh_ == nullptr) {
     LOGE("mesh has not been set\n");
     return false;
   }
 
-  if (flatten_vertices_.empty() || flatten_faces_.empty()) {
+  if (mesh_->vertices().empty() || mesh_->vertex_indices().empty()) {
     LOGE("mesh is empty\n");
     return false;
   }
 
-  bool ret = false;
-  build_options_.cache_bbox = false;
+  LOGI("num_triangles = %llu\n",
+       static_cast<uint64_t>(mesh_->vertex_indices().size()));
 
-  LOGI("  BVH build option:\n");
-  LOGI("    # of leaf primitives: %d\n", build_options_.min_leaf_primitives);
-  LOGI("    SAH binsize         : %d\n", build_options_.bin_size);
+  if (!PrepareMeshBvh(*mesh_, option_, bvh_build_option_, true, &bvh_)) {
+    return false;
+  }
+  built_sah_cost_ = bvh_.stats().sah_cost;
 
-  Timer<> timer;
-  timer.Start();
+  PrepareMipmaps(*mesh_, option_, &mipmaps_);
 
-  triangle_mesh_.reset(new nanort::TriangleMesh<float>(
-      &flatten_vertices_[0], &flatten_faces_[0], sizeof(float) * 3));
+  mesh_initialized_ = true;
 
-  triangle_pred_.reset(new nanort::TriangleSAHPred<float>(
-      &flatten_vertices_[0], &flatten_faces_[0], sizeof(float) * 3));
+  return true;
+}
 
-  LOGI("num_triangles = %llu\n",
-       static_cast<uint64_t>(mesh_->vertex_indices().size()));
-  // LOGI("faces = %p\n", mesh_->vertex_indices().size());
+bool Raytracer::Impl::PrepareScene() {
+  // all objects are validated before cached BVHs are taken out of mesh_bvhs_
+  for (int i = 0; i < scene_->num_objects(); i++) {
+    std::shared_ptr<const Mesh> mesh = scene_->mesh(i);
+    if (mesh == nullptr || mesh->vertices().empty() ||
+        mesh->vertex_indices().empty()) {
+      LOGE("mesh of %d th object is empty\n", i);
+      return false;
+    }
+  }
 
-  ret = accel_.Build(static_cast<unsigned int>(mesh_->vertex_indices().size()),
-                     *triangle_mesh_, *triangle_pred_, build_options_);
+  std::map<const Mesh*, MeshBvh> mesh_bvhs;
+  std::vector<BvhInstance> instances(scene_->num_objects());
+  scene_objects_.resize(scene_->num_objects());
+  int64_t num_triangles = 0;
+  for (int i = 0; i < scene_->num_objects(); i++) {
+    std::shared_ptr<const Mesh> mesh = scene_->mesh(i);
+    num_triangles += static_cast<int64_t>(mesh->vertex_indices().size());
+
+    // bottom-level BVH is built only for mesh not prepared before
+    MeshBvh& mesh_bvh = mesh_bvhs[mesh.get()];
+    if (mesh_bvh.bvh == nullptr) {
+      auto found = mesh_bvhs_.find(mesh.get());
+      if (found != mesh_bvhs_.end()) {
+        mesh_bvh = std::move(found->second);
+        mesh_bvhs_.erase(found);
+      } else {
+        mesh_bvh.mesh = mesh;
+        mesh_bvh.bvh.reset(new Bvh);
+        if (!PrepareMeshBvh(*mesh, option_, bvh_build_option_, true,
+                            mesh_bvh.bvh.get())) {
+          // BVHs prepared so far are kept for next call
+          mesh_bvhs.erase(mesh.get());
+          for (auto& prepared : mesh_bvhs) {
+            mesh_bvhs_[prepared.first] = std::move(prepared.second);
+          }
+          return false;
+        }
+      }
+      PrepareMipmaps(*mesh, option_, &mesh_bvh.mipmaps);
+    }
 
-  if (!ret) {
-    LOGE("BVH building failed\n");
-    return false;
+    const Eigen::Affine3d pose = scene_->pose(i);
+    instances[i].bvh = mesh_bvh.bvh.get();
+    instances[i].linear = pose.linear().cast<float>();
+    instances[i].translation = pose.translation().cast<float>();
+    scene_objects_[i].mesh = mesh;
+    scene_objects_[i].mipmaps = &mesh_bvh.mipmaps;
+    scene_objects_[i].linear = instances[i].linear;
+    scene_objects_[i].translation = instances[i].translation;
+    scene_objects_[i].normal_o2w =
+        instances[i].linear.inverse().transpose();
+    scene_objects_[i].rigid =
+        (instances[i].linear.transpose() * instances[i].linear)
+            .isIdentity(1.0e-5f);
   }
+  // BVHs of meshes removed from scene are released
+  mesh_bvhs_.swap(mesh_bvhs);
 
-  timer.End();
-  LOGI("  BVH build time: %.1f msecs\n", timer.elapsed_msec());
+  LOGI("num_objects = %d, num_meshes = %d, num_triangles = %lld\n",
+       scene_->num_objects(), static_cast<int>(mesh_bvhs_.size()),
+       static_cast<long long>(num_triangles));
 
-  stats_ = accel_.GetStatistics();
+  if (!top_level_bvh_.Build(instances)) {
+    LOGE("top-level BVH building failed\n");
+    return false;
+  }
+  LOGI("  Top-level BVH build time: %.1f msecs\n",
+       top_level_bvh_.stats().build_msec);
 
-  LOGI("  BVH statistics:\n");
-  LOGI("    # of leaf   nodes: %d\n", stats_.num_leaf_nodes);
-  LOGI("    # of branch nodes: %d\n", stats_.num_branch_nodes);
-  LOGI("  Max tree depth     : %d\n", stats_.max_tree_depth);
+  return true;
+}
 
-  accel_.BoundingBox(bmin_, bmax_);
-  LOGI("  Bmin               : %f, %f, %f\n", bmin_[0], bmin_[1], bmin_[2]);
-  LOGI("  Bmax               : %f, %f, %f\n", bmax_[0], bmax_[1], bmax_[2]);
+bool Raytracer::Impl::UpdateMesh(std::shared_ptr<const Mesh> mesh) {
+  if (!mesh_initialized_) {
+    LOGE("mesh has not been initialized\n");
+    return false;
+  }
+  if (scene_ != nullptr) {
+    LOGE("scene can not be updated. call PrepareMesh() after moving objects\n");
+    return false;
+  }
+  if (mesh == nullptr ||
+      mesh->vertices().size() != mesh_->vertices().size() ||
+      mesh->vertex_indices().size() != mesh_->vertex_indices().size()) {
+    LOGE("topology of mesh is different\n");
+    return false;
+  }
 
-  mesh_initialized_ = true;
+  mesh_ = mesh;
+  // textures are copied again only if their buffers are replaced. Hashing
+  // texels every frame costs more than refit
+  if (!MipmapsBuiltFrom(*mesh_, mipmaps_)) {
+    PrepareMipmaps(*mesh_, option_, &mipmaps_);
+  }
+
+  Timer<> timer;
+  timer.Start();
+  if (!bvh_.Refit(mesh_->vertices(), mesh_->vertex_indices())) {
+    LOGE("BVH refit failed\n");
+    mesh_initialized_ = false;
+    return false;
+  }
+  timer.End();
+  LOGI("  BVH refit time: %.1f msecs, SAH cost: %f\n", timer.elapsed_msec(),
+       bvh_.stats().sah_cost);
+
+  // rebuild if refitted bounds get too loose
+  if (bvh_.stats().sah_cost > built_sah_cost_ * kMaxSahCostGrowth) {
+    LOGI("  SAH cost grew from %f. rebuild BVH\n", built_sah_cost_);
+    if (!PrepareMeshBvh(*mesh_, option_, bvh_build_option_, false, &bvh_)) {
+      mesh_initialized_ = false;
+      return false;
+    }
+    built_sah_cost_ = bvh_.stats().sah_cost;
+  }
 
   return true;
 }
 
+void Raytracer::Impl::set_bvh_build_option(const BvhBuildOption& option) {
+  bvh_build_option_ = option;
+}
+
+const BvhStats& Raytracer::Impl::bvh_stats() const {
+  return scene_ != nullptr ? top_level_bvh_.stats() : bvh_.stats();
+}
+
 void Raytracer::Impl::set_camera(std::shared_ptr<const Camera> camera) {
   camera_ = camera;
 }
 
 bool Raytracer::Impl::Render(Image3b* color, Image1f* depth, Image3f* normal,
                              Image1b* mask, Image1i* face_id) const {
-  if (!ValidateAndInitBeforeRender(mesh_initialized_, camera_, mesh_, option_,
-                                   color, depth, normal, mask, face_id)) {
+  return Render(color, depth, normal, mask, face_id, nullptr);
+}
+
+bool Raytracer::Impl::Render(Image3b* color, Image1f* depth, Image3f* normal,
+                             Image1b* mask, Image1i* face_id,
+                             Image1i* object_id) const {
+  // all meshes of scene are validated
+  const bool use_scene = scene_ != nullptr;
+  if (use_scene && mesh_initialized_) {
+    for (const auto& mesh_bvh : mesh_bvhs_) {
+      if (!ValidateBeforeRender(mesh_initialized_, camera_,
+                                mesh_bvh.second.mesh, option_, color, depth,
+                                normal, mask, face_id)) {
+        return false;
+      }
+      if (color != nullptr &&
+          !ValidateMipmaps(*mesh_bvh.second.mesh, option_,
+                           mesh_bvh.second.mipmaps)) {
+        return false;
+      }
+    }
+  }
+  std::shared_ptr<const Mesh> first_mesh =
+      use_scene && !scene_objects_.empty() ? scene_objects_[0].mesh : mesh_;
+  if (!ValidateAndInitBeforeRender(mesh_initialized_, camera_, first_mesh,
+                                   option_, color, depth, normal, mask,
+                                   face_id)) {
+    return false;
+  }
+  if (!use_scene && color != nullptr &&
+      !ValidateMipmaps(*mesh_, option_, mipmaps_)) {
     return false;
   }
+  if (object_id != nullptr) {
+    Init(object_id, camera_->width(), camera_->height(), -1);
+  }
 
   // make pixel shader
   std::unique_ptr<PixelShader> pixel_shader = PixelShaderFactory::Create(
       option_.diffuse_color, option_.interp, option_.diffuse_shading);
 
-  OrenNayarParam oren_nayar_param(option_.oren_nayar_sigma);
+  // mesh attributes of each object are resolved once
+  std::vector<ShadingContext> contexts;
+  if (use_scene) {
+    contexts.reserve(scene_objects_.size());
+    for (const SceneObject& scene_object : scene_objects_) {
+      contexts.emplace_back(*scene_object.mesh, option_,
+                            scene_object.mipmaps);
+    }
+  } else {
+    contexts.emplace_back(*mesh_, option_, &mipmaps_);
+  }
+  const bool need_uv_derivatives =
+      option_.diffuse_color == DiffuseColor::kTexture &&
+      option_.interp == ColorInterpolation::kTrilinear;
 
   const Eigen::Matrix3f w2c_R = camera_->w2c().rotation().cast<float>();
   const Eigen::Vector3f w2c_t = camera_->w2c().translation().cast<float>();
+  ray_table_.Update(*camera_);
+
+  // only coverage is needed for mask. Any hit is enough unless back-face
+  // culling needs the nearest face
+  const bool any_hit = mask != nullptr && color == nullptr &&
+                       depth == nullptr && normal == nullptr &&
+                       face_id == nullptr && object_id == nullptr &&
+                       !option_.backface_culling;
+
+  const int width = camera_->width();
+  const int height = camera_->height();
+  const int tile_cols = (width + kTileSize - 1) / kTileSize;
+  const int tile_rows = (height + kTileSize - 1) / kTileSize;
 
   Timer<> timer;
   timer.Start();
 #if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
 #pragma omp parallel for schedule(dynamic, 1)
 #endif
-  for (int y = 0; y < camera_->height(); y++) {
-    for (int x = 0; x < camera_->width(); x++) {
-      // ray from camera position in world coordinate
-      Eigen::Vector3f ray_w, org_ray_w;
-      camera_->ray_w(x, y, &ray_w);
-      camera_->org_ray_w(x, y, &org_ray_w);
-      nanort::Ray<float> ray;
-      PrepareRay(&ray, org_ray_w, ray_w);
-
-      // shoot ray
-      nanort::TriangleIntersector<> triangle_intersector(
-          &flatten_vertices_[0], &flatten_faces_[0], sizeof(float) * 3);
-      nanort::TriangleIntersection<> isect;
-      bool hit = accel_.Traverse(ray, triangle_intersector, &isect);
-
-      if (!hit) {
-        continue;
-      }
-
-      unsigned int fid = isect.prim_id;
-      float u = isect.u;
-      float v = isect.v;
-
-      // back-face culling
-      if (option_.backface_culling) {
-        // back-face if face normal has same direction to ray
-        if (mesh_->face_normals()[fid].dot(ray_w) > 0) {
+  for (int tile = 0; tile < tile_cols * tile_rows; tile++) {
+    const int tile_x = (tile % tile_cols) * kTileSize;
+    const int tile_y = (tile / tile_cols) * kTileSize;
+    const int tile_x_end = std::min(tile_x + kTileSize, width);
+    const int tile_y_end = std::min(tile_y + kTileSize, height);
+    // hits of tile are shaded in batches
+    ShadingBatch batch;
+    for (int py = tile_y; py < tile_y_end; py += kPacketWidth) {
+      for (int px = tile_x; px < tile_x_end; px += kPacketWidth) {
+        // rays from camera position in world coordinate
+        RayPacket packet;
+        Eigen::Vector3f ray_ws[kPacketSize], org_ray_ws[kPacketSize];
+        bool any_active = false;
+        for (int j = 0; j < kPacketSize; j++) {
+          const int x = std::min(px + j % kPacketWidth, width - 1);
+          const int y = std::min(py + j / kPacketWidth, height - 1);
+          Eigen::Vector3f& ray_w = ray_ws[j];
+          Eigen::Vector3f& org_ray_w = org_ray_ws[j];
+          ray_table_.ray_w(x, y, &ray_w);
+          ray_table_.org_ray_w(x, y, &org_ray_w);
+
+          // near and far plane in ray parameter
+          // z in camera coordinate is linear to t along ray
+          // rays outside of image or range are inactive with empty range
+          const float org_z = w2c_R.row(2).dot(org_ray_w) + w2c_t.z();
+          const float ray_z = w2c_R.row(2).dot(ray_w);
+          float min_t = 1.0f;
+          float max_t = 0.0f;
+          if (ray_z > 0.0f && px + j % kPacketWidth < width &&
+              py + j / kPacketWidth < height &&
+              (option_.far_z - org_z) / ray_z > 0.0f) {
+            min_t = std::max((option_.near_z - org_z) / ray_z, 0.0f);
+            max_t = std::min((option_.far_z - org_z) / ray_z, kFar);
+            any_active |= min_t <= max_t;
+          }
+          SetRay(&packet, j, org_ray_w, ray_w, min_t, max_t);
+        }
+        if (!any_active) {
           continue;
         }
-      }
-
-      // fill face id
-      if (face_id != nullptr) {
-        face_id->at<int>(y, x) = fid;
-      }
-
-      // fill mask
-      if (mask != nullptr) {
-        mask->at<unsigned char>(y, x) = 255;
-      }
-
-      // convert hit position to camera coordinate to get depth value
-      if (depth != nullptr) {
-        Eigen::Vector3f hit_pos_w = org_ray_w + ray_w * isect.t;
-        Eigen::Vector3f hit_pos_c = w2c_R * hit_pos_w + w2c_t;
-        assert(0.0f <= hit_pos_c[2]);  // depth should be positive
-        depth->at<float>(y, x) = hit_pos_c[2] * option_.depth_scale;
-      }
-
-      // calculate shading normal
-      Eigen::Vector3f shading_normal_w = Eigen::Vector3f::Zero();
-      if (option_.shading_normal == ShadingNormal::kFace) {
-        shading_normal_w = mesh_->face_normals()[fid];
-      } else if (option_.shading_normal == ShadingNormal::kVertex) {
-        // barycentric interpolation of normal
-        const auto& normals = mesh_->normals();
-        const auto& normal_indices = mesh_->normal_indices();
-        shading_normal_w = (1.0f - u - v) * normals[normal_indices[fid][0]] +
-                           u * normals[normal_indices[fid][1]] +
-                           v * normals[normal_indices[fid][2]];
-      }
 
-      // set shading normal
-      if (normal != nullptr) {
-        Eigen::Vector3f shading_normal_c =
-            w2c_R * shading_normal_w;  // rotate to camera coordinate
-        Vec3f& n = normal->at<Vec3f>(y, x);
-        for (int k = 0; k < 3; k++) {
-          n[k] = shading_normal_c[k];
+        // shoot rays
+        if (any_hit) {
+          if (use_scene) {
+            top_level_bvh_.Occluded(&packet);
+          } else {
+            bvh_.Occluded(&packet);
+          }
+          for (int j = 0; j < kPacketSize; j++) {
+            if (packet.prim_id[j] >= 0) {
+              mask->at<unsigned char>(py + j / kPacketWidth,
+                                      px + j % kPacketWidth) = 255;
+            }
+          }
+          continue;
+        }
+        if (use_scene) {
+          top_level_bvh_.Intersect(&packet);
+        } else {
+          bvh_.Intersect(&packet);
         }
-      }
 
-      // delegate color calculation to pixel_shader
-      if (color != nullptr) {
-        Eigen::Vector3f light_dir = ray_w;  // emit light same as ray
-        PixelShaderInput pixel_shader_input(color, x, y, u, v, fid, &ray_w,
-                                            &light_dir, &shading_normal_w,
-                                            &oren_nayar_param, mesh_);
-        pixel_shader->Process(pixel_shader_input);
+        for (int j = 0; j < kPacketSize; j++) {
+          if (packet.prim_id[j] < 0) {
+            continue;
+          }
+          const int x = px + j % kPacketWidth;
+          const int y = py + j / kPacketWidth;
+          const Eigen::Vector3f& ray_w = ray_ws[j];
+          const Eigen::Vector3f& org_ray_w = org_ray_ws[j];
+
+          unsigned int fid = static_cast<unsigned int>(packet.prim_id[j]);
+          float u = packet.u[j];
+          float v = packet.v[j];
+
+          // normals of object are transformed to world coordinate
+          // and normalized again if scaled
+          const int object = use_scene ? packet.instance_id[j] : 0;
+          const ShadingContext& context = contexts[object];
+          auto to_world = [&](const Eigen::Vector3f& n) -> Eigen::Vector3f {
+            if (!use_scene) {
+              return n;
+            }
+            const SceneObject& scene_object = scene_objects_[object];
+            const Eigen::Vector3f n_w = scene_object.normal_o2w * n;
+            return scene_object.rigid ? n_w : n_w.normalized();
+          };
+
+          // back-face culling
+          if (option_.backface_culling) {
+            // back-face if face normal has same direction to ray
+            if (to_world(context.face_normals[fid]).dot(ray_w) > 0) {
+              continue;
+            }
+          }
+
+          // fill face id
+          if (face_id != nullptr) {
+            face_id->at<int>(y, x) = fid;
+          }
+
+          // fill object id
+          if (object_id != nullptr) {
+            object_id->at<int>(y, x) = object;
+          }
+
+          // fill mask
+          if (mask != nullptr) {
+            mask->at<unsigned char>(y, x) = 255;
+          }
+
+          // convert hit position to camera coordinate to get depth value
+          if (depth != nullptr) {
+            Eigen::Vector3f hit_pos_w = org_ray_w + ray_w * packet.max_t[j];
+            Eigen::Vector3f hit_pos_c = w2c_R * hit_pos_w + w2c_t;
+            assert(0.0f <= hit_pos_c[2]);  // depth should be positive
+            depth->at<float>(y, x) = hit_pos_c[2] * option_.depth_scale;
+          }
+
+          // calculate shading normal
+          Eigen::Vector3f shading_normal_w = Eigen::Vector3f::Zero();
+          if (option_.shading_normal == ShadingNormal::kFace) {
+            shading_normal_w = to_world(context.face_normals[fid]);
+          } else if (option_.shading_normal == ShadingNormal::kVertex) {
+            // barycentric interpolation of normal
+            const Eigen::Vector3f* normals = context.normals;
+            const Eigen::Vector3i* normal_indices = context.normal_indices;
+            shading_normal_w =
+                to_world((1.0f - u - v) * normals[normal_indices[fid][0]] +
+                         u * normals[normal_indices[fid][1]] +
+                         v * normals[normal_indices[fid][2]]);
+          }
+
+          // set shading normal
+          if (normal != nullptr) {
+            Eigen::Vector3f shading_normal_c =
+                w2c_R * shading_normal_w;  // rotate to camera coordinate
+            Vec3f& n = normal->at<Vec3f>(y, x);
+            for (int k = 0; k < 3; k++) {
+              n[k] = shading_normal_c[k];
+            }
+          }
+
+          // delegate color calculation to pixel_shader
+          if (color != nullptr) {
+            // footprint of pixel on triangle in world coordinate
+            float uv_derivatives[4];
+            if (need_uv_derivatives) {
+              const Eigen::Vector3i& face = context.faces[fid];
+              Eigen::Vector3f face_w[3];
+              for (int k = 0; k < 3; k++) {
+                face_w[k] = context.vertices[face[k]];
+                if (use_scene) {
+                  const SceneObject& scene_object = scene_objects_[object];
+                  face_w[k] = scene_object.linear * face_w[k] +
+                              scene_object.translation;
+                }
+              }
+              BarycentricDerivatives(ray_table_, x, y, face_w[0], face_w[1],
+                                     face_w[2], uv_derivatives);
+            }
+            pixel_shader->Push(&context, x, y, u, v, fid, ray_w,
+                               shading_normal_w, &batch, color,
+                               need_uv_derivatives ? uv_derivatives : nullptr);
+          }
+        }
       }
     }
+    if (color != nullptr) {
+      pixel_shader->Flush(&batch, color);
+    }
   }
   timer.End();
   LOGI("  Rendering main loop time: %.1f msecs\n", timer.elapsed_msec());
@@ -314,6 +612,102 @@ bool Raytracer::Impl::RenderFaceId(Image1i* face_id) const {
   return Render(nullptr, nullptr, nullptr, nullptr, face_id);
 }
 
+bool Raytracer::Impl::RenderObjectId(Image1i* object_id) const {
+  if (object_id == nullptr) {
+    LOGE("object_id is nullptr");
+    return false;
+  }
+
+  // face id is rendered together as the main output
+  Image1i face_id;
+  return Render(nullptr, nullptr, nullptr, nullptr, &face_id, object_id);
+}
+
+bool Raytracer::Impl::IsVisible(const std::vector<Eigen::Vector3f>& points,
+                                std::vector<unsigned char>* visible,
+                                float eps) const {
+  if (visible == nullptr) {
+    LOGE("visible is nullptr\n");
+    return false;
+  }
+  if (camera_ == nullptr) {
+    LOGE("camera has not been set\n");
+    return false;
+  }
+  if (!mesh_initialized_) {
+    LOGE("mesh has not been initialized\n");
+    return false;
+  }
+
+  const int num_points = static_cast<int>(points.size());
+  visible->assign(num_points, 0);
+
+  const Eigen::Matrix3f w2c_R = camera_->w2c().rotation().cast<float>();
+  const Eigen::Vector3f w2c_t = camera_->w2c().translation().cast<float>();
+  const float max_x = camera_->width() - 0.5f;
+  const float max_y = camera_->height() - 0.5f;
+  const bool use_scene = scene_ != nullptr;
+
+  // segment from ray origin of projected position to point is tested for
+  // any hit in the same near range as Render(). Points are packed in order
+  // since nearby points of mesh are usually coherent
+  const int num_packets = (num_points + kPacketSize - 1) / kPacketSize;
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+  for (int i = 0; i < num_packets; i++) {
+    RayPacket packet;
+    bool any_active = false;
+    for (int j = 0; j < kPacketSize; j++) {
+      const int index = i * kPacketSize + j;
+      Eigen::Vector3f org_ray_w = Eigen::Vector3f::Zero();
+      Eigen::Vector3f ray_w = Eigen::Vector3f::Zero();
+      float min_t = 1.0f;
+      float max_t = 0.0f;
+      if (index < num_points) {
+        const Eigen::Vector3f& p_w = points[index];
+        const Eigen::Vector3f p_c = w2c_R * p_w + w2c_t;
+        Eigen::Vector3f p_i = Eigen::Vector3f::Constant(-1.0f);
+        if (option_.near_z <= p_c.z() && p_c.z() <= option_.far_z) {
+          camera_->Project(p_c, &p_i);
+        }
+        if (-0.5f <= p_i.x() && p_i.x() <= max_x && -0.5f <= p_i.y() &&
+            p_i.y() <= max_y) {
+          camera_->org_ray_w(p_i.x(), p_i.y(), &org_ray_w);
+          ray_w = p_w - org_ray_w;
+          const float org_z = w2c_R.row(2).dot(org_ray_w) + w2c_t.z();
+          const float ray_z = p_c.z() - org_z;
+          min_t = ray_z > 0.0f
+                      ? std::max((option_.near_z - org_z) / ray_z, 0.0f)
+                      : 0.0f;
+          max_t = 1.0f - eps;
+          // visible if nothing is in between
+          visible->at(index) = 255;
+          any_active |= min_t <= max_t;
+        }
+      }
+      SetRay(&packet, j, org_ray_w, ray_w, min_t, max_t);
+    }
+    if (!any_active) {
+      continue;
+    }
+
+    if (use_scene) {
+      top_level_bvh_.Occluded(&packet);
+    } else {
+      bvh_.Occluded(&packet);
+    }
+
+    for (int j = 0; j < kPacketSize; j++) {
+      if (packet.prim_id[j] >= 0) {
+        visible->at(i * kPacketSize + j) = 0;
+      }
+    }
+  }
+
+  return true;
+}
+
 bool Raytracer::Impl::RenderW(Image3b* color, Image1w* depth, Image3f* normal,
                               Image1b* mask, Image1i* face_id) const {
   if (depth == nullptr) {
@@ -351,8 +745,22 @@ void Raytracer::set_mesh(std::shared_ptr<const Mesh> mesh) {
   pimpl_->set_mesh(mesh);
 }
 
+void Raytracer::set_scene(std::shared_ptr<const Scene> scene) {
+  pimpl_->set_scene(scene);
+}
+
 bool Raytracer::PrepareMesh() { return pimpl_->PrepareMesh(); }
 
+bool Raytracer::UpdateMesh(std::shared_ptr<const Mesh> mesh) {
+  return pimpl_->UpdateMesh(mesh);
+}
+
+void Raytracer::set_bvh_build_option(const BvhBuildOption& option) {
+  pimpl_->set_bvh_build_option(option);
+}
+
+const BvhStats& Raytracer::bvh_stats() const { return pimpl_->bvh_stats(); }
+
 void Raytracer::set_camera(std::shared_ptr<const Camera> camera) {
   pimpl_->set_camera(camera);
 }
@@ -382,6 +790,16 @@ bool Raytracer::RenderFaceId(Image1i* face_id) const {
   return pimpl_->RenderFaceId(face_id);
 }
 
+bool Raytracer::RenderObjectId(Image1i* object_id) const {
+  return pimpl_->RenderObjectId(object_id);
+}
+
+bool Raytracer::IsVisible(const std::vector<Eigen::Vector3f>& points,
+                          std::vector<unsigned char>* visible,
+                          float eps) const {
+  return pimpl_->IsVisible(points, visible, eps);
+}
+
 bool Raytracer::RenderW(Image3b* color, Image1w* depth, Image3f* normal,
                         Image1b* mask, Image1i* face_id) const {
   return pimpl_->RenderW(color, depth, normal, mask, face_id);
@@ -392,5 +810,3 @@ bool Raytracer::RenderDepthW(Image1w* depth) const {
 }
 
 }  // namespace currender
-
-#endif
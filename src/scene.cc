@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "currender/scene.h"
+
+#include "ugu/common.h"
+
+namespace currender {
+
+Scene::Scene() {}
+Scene::~Scene() {}
+
+int Scene::AddObject(std::shared_ptr<const Mesh> mesh,
+                     const Eigen::Affine3d& pose) {
+  Object object;
+  object.mesh = mesh;
+  object.rotation = pose.linear();
+  object.translation = pose.translation();
+  objects_.push_back(object);
+  return static_cast<int>(objects_.size()) - 1;
+}
+
+void Scene::Clear() { objects_.clear(); }
+
+bool Scene::set_pose(int id, const Eigen::Affine3d& pose) {
+  if (id < 0 || num_objects() <= id) {
+    LOGE("object id %d is out of range\n", id);
+    return false;
+  }
+  objects_[id].rotation = pose.linear();
+  objects_[id].translation = pose.translation();
+  return true;
+}
+
+Eigen::Affine3d Scene::pose(int id) const {
+  Eigen::Affine3d pose = Eigen::Affine3d::Identity();
+  if (id < 0 || num_objects() <= id) {
+    LOGE("object id %d is out of range\n", id);
+    return pose;
+  }
+  pose.linear() = objects_[id].rotation;
+  pose.translation() = objects_[id].translation;
+  return pose;
+}
+
+int Scene::num_objects() const { return static_cast<int>(objects_.size()); }
+
+std::shared_ptr<const Mesh> Scene::mesh(int id) const {
+  if (id < 0 || num_objects() <= id) {
+    LOGE("object id %d is out of range\n", id);
+    return nullptr;
+  }
+  return objects_[id].mesh;
+}
+
+}  // namespace currender
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+// Kernels to compute diffuse lighting coefficients of a batch of pixels.
+// Compiled in the same translation units as raster kernels with instruction
+// set specific flags, and the best one for running CPU is selected at
+// runtime. Thus this header must not depend on anything but plain types.
+
+namespace currender {
+
+// # of pixels processed by a kernel call. Lanes of vectors narrower than this
+// are processed in turn
+const int kShadeKernelWidth = 16;
+
+enum class ShadeModel { kLambertian = 0, kOrenNayar = 1 };
+
+// Raw view of a batch in structure of arrays. Each array has
+// kShadeKernelWidth elements and ones not less than size are ignored
+struct ShadeInput {
+  const float* normal[3];  // shading normal
+  const float* light[3];   // direction of light travel
+  const float* ray[3];     // direction of view ray
+  int size;
+  float oren_nayar_a;
+  float oren_nayar_b;
+};
+
+// Writes coefficient of all kShadeKernelWidth lanes. Lanes not less than
+// size are zero
+typedef void (*ShadeKernel)(const ShadeInput& input,
+                            float coeff[kShadeKernelWidth]);
+
+// Each returns nullptr if the kernel is not compiled
+ShadeKernel GetShadeKernelScalar(ShadeModel model);
+ShadeKernel GetShadeKernelSse41(ShadeModel model);
+ShadeKernel GetShadeKernelAvx2(ShadeModel model);
+ShadeKernel GetShadeKernelAvx512(ShadeModel model);
+
+// Returns the fastest kernel supported by running CPU
+// name is set if not nullptr
+ShadeKernel GetShadeKernel(ShadeModel model, const char** name = nullptr);
+
+}  // namespace currender
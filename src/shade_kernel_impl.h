@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+// Template of lighting kernels shared by all instruction sets.
+// This header is included by each raster_kernel_*.cc after its Ops and has the
+// same restrictions as raster_kernel_impl.h.
+// Trigonometric functions of Oren-Nayar model are replaced by their relations
+// to cosine (dot product), so that only arithmetic and square root are needed.
+
+#include <cfloat>
+
+#include "src/raster_kernel_impl.h"
+#include "src/shade_kernel.h"
+
+namespace currender {
+namespace {
+
+// Loads lanes [j, j + Ops::kWidth) of src. Lanes not less than size are zero
+template <typename Ops>
+inline void LoadShadeLanes(const float* const src[3], int j, int size,
+                           typename Ops::F dst[3]) {
+  typedef typename Ops::F F;
+  const F lane = Ops::Add(Ops::Set1(static_cast<float>(j)), Ops::Iota());
+  const typename Ops::M valid =
+      Ops::CmpLt(lane, Ops::Set1(static_cast<float>(size)));
+  for (int k = 0; k < 3; k++) {
+    dst[k] = Ops::Select(valid, Ops::Load(src[k] + j), Ops::Set1(0.0f));
+  }
+}
+
+template <typename Ops>
+inline typename Ops::F ShadeDot(const typename Ops::F a[3],
+                                const typename Ops::F b[3]) {
+  return Ops::Add(Ops::Add(Ops::Mul(a[0], b[0]), Ops::Mul(a[1], b[1])),
+                  Ops::Mul(a[2], b[2]));
+}
+
+template <typename Ops>
+void ShadeLambertian(const ShadeInput& input, float coeff[kShadeKernelWidth]) {
+  typedef typename Ops::F F;
+  const F zero = Ops::Set1(0.0f);
+  for (int j = 0; j < kShadeKernelWidth; j += Ops::kWidth) {
+    F n[3], l[3];
+    LoadShadeLanes<Ops>(input.normal, j, input.size, n);
+    LoadShadeLanes<Ops>(input.light, j, input.size, l);
+
+    // dot product of normal and inverse light direction
+    // if negative (may happen at back-face or occluding boundary), bound to 0
+    Ops::Store(coeff + j, Ops::Max(Ops::Sub(zero, ShadeDot<Ops>(l, n)), zero));
+  }
+}
+
+template <typename Ops>
+void ShadeOrenNayar(const ShadeInput& input, float coeff[kShadeKernelWidth]) {
+  typedef typename Ops::F F;
+  const F zero = Ops::Set1(0.0f);
+  const F one = Ops::Set1(1.0f);
+  const F tiny = Ops::Set1(FLT_MIN);
+  const F a = Ops::Set1(input.oren_nayar_a);
+  const F b = Ops::Set1(input.oren_nayar_b);
+  for (int j = 0; j < kShadeKernelWidth; j += Ops::kWidth) {
+    F n[3], l[3], r[3];
+    LoadShadeLanes<Ops>(input.normal, j, input.size, n);
+    LoadShadeLanes<Ops>(input.light, j, input.size, l);
+    LoadShadeLanes<Ops>(input.ray, j, input.size, r);
+
+    // cosine of angles against normal
+    const F cos_i = Ops::Sub(zero, ShadeDot<Ops>(l, n));
+    const F cos_r = Ops::Sub(zero, ShadeDot<Ops>(r, n));
+
+    // angle against binormal (perpendicular to normal)
+    F phi_diff_cos = zero;
+    for (int k = 0; k < 3; k++) {
+      const F binormal_light = Ops::Sub(Ops::Sub(zero, Ops::Mul(n[k], cos_i)),
+                                        l[k]);
+      const F binormal_ray = Ops::Sub(Ops::Sub(zero, Ops::Mul(n[k], cos_r)),
+                                      r[k]);
+      phi_diff_cos =
+          Ops::Add(phi_diff_cos, Ops::Mul(binormal_light, binormal_ray));
+    }
+    phi_diff_cos = Ops::Max(phi_diff_cos, zero);
+
+    // alpha = max(theta_i, theta_r) and beta = min(theta_i, theta_r) in
+    // [0, pi]. cosine decreases there, so sin(alpha) = sqrt(1 - cos^2) of
+    // the smaller cosine and tan(beta) = sin / cos of the larger one
+    // tan(beta) is left 0 where cos(beta) <= 0 since cos_i <= 0 there and the
+    // coefficient is 0 anyway
+    const F cos_alpha = Ops::Min(cos_i, cos_r);
+    const F cos_beta = Ops::Max(cos_i, cos_r);
+    const F sin_alpha =
+        Ops::Sqrt(Ops::Max(Ops::Sub(one, Ops::Mul(cos_alpha, cos_alpha)),
+                           zero));
+    const F sin_beta = Ops::Sqrt(
+        Ops::Max(Ops::Sub(one, Ops::Mul(cos_beta, cos_beta)), zero));
+    const F tan_beta =
+        Ops::Select(Ops::CmpLt(cos_beta, tiny), zero,
+                    Ops::Div(sin_beta, Ops::Max(cos_beta, tiny)));
+
+    const F c = Ops::Mul(
+        Ops::Max(cos_i, zero),
+        Ops::Add(a, Ops::Mul(Ops::Mul(Ops::Mul(b, phi_diff_cos), sin_alpha),
+                             tan_beta)));
+    Ops::Store(coeff + j, c);
+  }
+}
+
+// Instance of lighting kernel for model
+template <typename Ops>
+ShadeKernel SelectShadeKernel(ShadeModel model) {
+  switch (model) {
+    case ShadeModel::kLambertian:
+      return &ShadeLambertian<Ops>;
+    case ShadeModel::kOrenNayar:
+      return &ShadeOrenNayar<Ops>;
+  }
+  return nullptr;
+}
+
+}  // namespace
+}  // namespace currender
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#include "src/tiled_texture.h"
+
+namespace {
+
+const int kTileWidth = 4;
+const size_t kTileTexels = kTileWidth * kTileWidth;
+const size_t kAlignment = 64;  // bytes
+
+}  // namespace
+
+namespace currender {
+
+TiledTexture::TiledTexture() {}
+TiledTexture::~TiledTexture() {}
+
+void TiledTexture::Init(int cols, int rows) {
+  cols_ = cols;
+  rows_ = rows;
+  tiles_x_ = (cols + kTileWidth - 1) / kTileWidth;
+  const int tiles_y = (rows + kTileWidth - 1) / kTileWidth;
+
+  // padded to align the first tile
+  const size_t num_texels =
+      static_cast<size_t>(tiles_x_) * tiles_y * kTileTexels;
+  const size_t padding = kAlignment / sizeof(uint32_t);
+  storage_.assign(num_texels + padding, 0);
+  const uintptr_t address = reinterpret_cast<uintptr_t>(storage_.data());
+  const uintptr_t aligned = (address + kAlignment - 1) & ~(kAlignment - 1);
+  texels_ = storage_.data() + (aligned - address) / sizeof(uint32_t);
+}
+
+void TiledTexture::Build(const Image3b& image) {
+  Init(image.cols, image.rows);
+#if defined(_OPENMP) && defined(CURRENDER_USE_OPENMP)
+#pragma omp parallel for schedule(static)
+#endif
+  for (int y = 0; y < rows_; y++) {
+    for (int x = 0; x < cols_; x++) {
+      const Vec3b& src = image.at<Vec3b>(y, x);
+      uint8_t* dst = at(y, x);
+      for (int k = 0; k < 3; k++) {
+        dst[k] = src[k];
+      }
+    }
+  }
+}
+
+void TiledTexture::Clear() {
+  storage_.clear();
+  storage_.shrink_to_fit();
+  texels_ = nullptr;
+  cols_ = 0;
+  rows_ = 0;
+  tiles_x_ = 0;
+}
+
+}  // namespace currender
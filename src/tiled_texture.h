@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019, unclearness
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "currender/renderer.h"
+
+namespace currender {
+
+// Copy of texture in square tiles of 4 x 4 texels with 4 bytes each (RGB and
+// padding). A tile is 64 bytes aligned to a cache line, so 2x2 footprint of
+// bilinear sampling and fetches of neighboring pixels mostly stay in the same
+// cache line while rows of row-major image are far apart
+class TiledTexture {
+  std::vector<uint32_t> storage_;
+  uint32_t* texels_{nullptr};  // aligned in storage_
+  int cols_{0};
+  int rows_{0};
+  int tiles_x_{0};
+
+  size_t Index(int y, int x) const {
+    return ((static_cast<size_t>(y >> 2) * tiles_x_ + (x >> 2)) << 4) +
+           ((y & 3) << 2) + (x & 3);
+  }
+
+ public:
+  TiledTexture();
+  ~TiledTexture();
+  TiledTexture(const TiledTexture&) = delete;
+  TiledTexture& operator=(const TiledTexture&) = delete;
+  TiledTexture(TiledTexture&&) = default;
+  TiledTexture& operator=(TiledTexture&&) = default;
+
+  // Allocates texels. Contents are not initialized
+  void Init(int cols, int rows);
+  // Copies image
+  void Build(const Image3b& image);
+  void Clear();
+
+  int cols() const { return cols_; }
+  int rows() const { return rows_; }
+
+  // RGB of texel at row y and column x
+  const uint8_t* at(int y, int x) const {
+    return reinterpret_cast<const uint8_t*>(texels_ + Index(y, x));
+  }
+  uint8_t* at(int y, int x) {
+    return reinterpret_cast<uint8_t*>(texels_ + Index(y, x));
+  }
+};
+
+}  // namespace currender
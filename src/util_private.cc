@@ -5,16 +5,42 @@
 
 #include "src/util_private.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <numeric>
+
+namespace {
+
+// Inserts two zero bits between each of lower 10 bits
+inline uint32_t ExpandBits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// Finalizer of MurmurHash3
+inline uint64_t Mix64(uint64_t v) {
+  v ^= v >> 33;
+  v *= 0xFF51AFD7ED558CCDull;
+  v ^= v >> 33;
+  v *= 0xC4CEB9FE1A85EC53ull;
+  v ^= v >> 33;
+  return v;
+}
+
+}  // namespace
 
 namespace currender {
 
-bool ValidateAndInitBeforeRender(bool mesh_initialized,
-                                 std::shared_ptr<const Camera> camera,
-                                 std::shared_ptr<const Mesh> mesh,
-                                 const RendererOption& option, Image3b* color,
-                                 Image1f* depth, Image3f* normal, Image1b* mask,
-                                 Image1i* face_id) {
+bool ValidateBeforeRender(bool mesh_initialized,
+                          std::shared_ptr<const Camera> camera,
+                          std::shared_ptr<const Mesh> mesh,
+                          const RendererOption& option, Image3b* color,
+                          Image1f* depth, Image3f* normal, Image1b* mask,
+                          Image1i* face_id) {
   if (camera == nullptr) {
     LOGE("camera has not been set\n");
     return false;
@@ -59,17 +85,35 @@ bool ValidateAndInitBeforeRender(bool mesh_initialized,
         "empty.\n");
     return false;
   }
+  if (!(0.0f < option.near_z && option.near_z < option.far_z)) {
+    LOGE("near_z and far_z must be 0 < near_z < far_z\n");
+    return false;
+  }
   if (color == nullptr && depth == nullptr && normal == nullptr &&
       mask == nullptr && face_id == nullptr) {
     LOGE("all arguments are nullptr. nothing to do\n");
     return false;
   }
 
+  return true;
+}
+
+bool ValidateAndInitBeforeRender(bool mesh_initialized,
+                                 std::shared_ptr<const Camera> camera,
+                                 std::shared_ptr<const Mesh> mesh,
+                                 const RendererOption& option, Image3b* color,
+                                 Image1f* depth, Image3f* normal, Image1b* mask,
+                                 Image1i* face_id) {
+  if (!ValidateBeforeRender(mesh_initialized, camera, mesh, option, color,
+                            depth, normal, mask, face_id)) {
+    return false;
+  }
+
   int width = camera->width();
   int height = camera->height();
 
   if (color != nullptr) {
-    Init(color, width, height, unsigned char(0));
+    Init(color, width, height, static_cast<unsigned char>(0));
   }
   if (depth != nullptr) {
     Init(depth, width, height, 0.0f);
@@ -78,7 +122,7 @@ bool ValidateAndInitBeforeRender(bool mesh_initialized,
     Init(normal, width, height, 0.0f);
   }
   if (mask != nullptr) {
-    Init(mask, width, height, unsigned char(0));
+    Init(mask, width, height, static_cast<unsigned char>(0));
   }
   if (face_id != nullptr) {
     // initialize with -1 (no hit)
@@ -88,4 +132,90 @@ bool ValidateAndInitBeforeRender(bool mesh_initialized,
   return true;
 }
 
+uint32_t MortonCode(const Eigen::Vector3f& p, const Eigen::Vector3f& bb_min,
+                    const Eigen::Vector3f& bb_max) {
+  uint32_t code[3];
+  for (int k = 0; k < 3; k++) {
+    const float len = bb_max[k] - bb_min[k];
+    float t = len > 0.0f ? (p[k] - bb_min[k]) / len : 0.0f;
+    t = std::min(std::max(t * 1024.0f, 0.0f), 1023.0f);
+    code[k] = ExpandBits(static_cast<uint32_t>(t));
+  }
+  return (code[0] << 2) | (code[1] << 1) | code[2];
+}
+
+void MortonFaceOrder(const std::vector<Eigen::Vector3f>& vertices,
+                     const std::vector<Eigen::Vector3i>& faces,
+                     std::vector<int>* face_order) {
+  const int face_num = static_cast<int>(faces.size());
+
+  std::vector<Eigen::Vector3f> centroids(face_num);
+  Eigen::Vector3f bb_min =
+      Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+  Eigen::Vector3f bb_max =
+      Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+  for (int i = 0; i < face_num; i++) {
+    centroids[i] = (vertices[faces[i][0]] + vertices[faces[i][1]] +
+                    vertices[faces[i][2]]) /
+                   3.0f;
+    bb_min = bb_min.cwiseMin(centroids[i]);
+    bb_max = bb_max.cwiseMax(centroids[i]);
+  }
+
+  std::vector<uint32_t> codes(face_num);
+  for (int i = 0; i < face_num; i++) {
+    codes[i] = MortonCode(centroids[i], bb_min, bb_max);
+  }
+  face_order->resize(face_num);
+  std::iota(face_order->begin(), face_order->end(), 0);
+  std::stable_sort(face_order->begin(), face_order->end(),
+                   [&codes](int i1, int i2) { return codes[i1] < codes[i2]; });
+}
+
+void ReorderMesh(const std::vector<Eigen::Vector3f>& vertices,
+                 const std::vector<Eigen::Vector3i>& faces,
+                 std::vector<Eigen::Vector3f>* reordered_vertices,
+                 std::vector<Eigen::Vector3i>* reordered_faces,
+                 std::vector<int>* face_order) {
+  const int face_num = static_cast<int>(faces.size());
+  MortonFaceOrder(vertices, faces, face_order);
+
+  // new vertex index in the order of first reference. unreferenced vertices
+  // are put at the end
+  std::vector<int> vertex_map(vertices.size(), -1);
+  reordered_vertices->clear();
+  reordered_vertices->reserve(vertices.size());
+  reordered_faces->resize(face_num);
+  for (int j = 0; j < face_num; j++) {
+    const Eigen::Vector3i& face = faces[(*face_order)[j]];
+    for (int k = 0; k < 3; k++) {
+      if (vertex_map[face[k]] < 0) {
+        vertex_map[face[k]] = static_cast<int>(reordered_vertices->size());
+        reordered_vertices->push_back(vertices[face[k]]);
+      }
+      (*reordered_faces)[j][k] = vertex_map[face[k]];
+    }
+  }
+  for (size_t i = 0; i < vertices.size(); i++) {
+    if (vertex_map[i] < 0) {
+      reordered_vertices->push_back(vertices[i]);
+    }
+  }
+}
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t hash = Mix64(seed ^ size);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (hash ^ Mix64(word)) * 0x9E3779B97F4A7C15ull;
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, bytes + i, size - i);
+  hash = (hash ^ Mix64(tail)) * 0x9E3779B97F4A7C15ull;
+  return Mix64(hash);
+}
+
 }  // namespace currender
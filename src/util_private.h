@@ -5,13 +5,26 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <memory>
+#include <vector>
 
 #include "currender/renderer.h"
 
 namespace currender {
 
+// Checks mesh, camera, option and outputs
+bool ValidateBeforeRender(bool mesh_initialized,
+                          std::shared_ptr<const Camera> camera,
+                          std::shared_ptr<const Mesh> mesh,
+                          const RendererOption& option, Image3b* color,
+                          Image1f* depth, Image3f* normal, Image1b* mask,
+                          Image1i* face_id);
+
+// ValidateBeforeRender() and initializes non-null outputs with zero (-1 for
+// face id)
 bool ValidateAndInitBeforeRender(bool mesh_initialized,
                                  std::shared_ptr<const Camera> camera,
                                  std::shared_ptr<const Mesh> mesh,
@@ -19,4 +32,35 @@ bool ValidateAndInitBeforeRender(bool mesh_initialized,
                                  Image1f* depth, Image3f* normal, Image1b* mask,
                                  Image1i* face_id);
 
+// Reallocates image only if its size is different. Contents are not
+// initialized
+template <typename T>
+void Resize(Image<T>* image, int width, int height) {
+  if (image->cols != width || image->rows != height) {
+    Init(image, width, height, 0);
+  }
+}
+
+// 30 bit Morton code (Z-order curve) of a point in bounding box
+// Points close in space get close codes
+uint32_t MortonCode(const Eigen::Vector3f& p, const Eigen::Vector3f& bb_min,
+                    const Eigen::Vector3f& bb_max);
+
+// Face indices sorted along Morton order of their centroids
+void MortonFaceOrder(const std::vector<Eigen::Vector3f>& vertices,
+                     const std::vector<Eigen::Vector3i>& faces,
+                     std::vector<int>* face_order);
+
+// Reorders faces along Morton order of their centroids and vertices in the
+// order of first reference by the reordered faces for memory locality
+// face_order[i] is the original index of i-th reordered face
+void ReorderMesh(const std::vector<Eigen::Vector3f>& vertices,
+                 const std::vector<Eigen::Vector3i>& faces,
+                 std::vector<Eigen::Vector3f>* reordered_vertices,
+                 std::vector<Eigen::Vector3i>* reordered_faces,
+                 std::vector<int>* face_order);
+
+// 64 bit non-cryptographic hash of bytes to identify data (e.g. cache key)
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0);
+
 }  // namespace currender